@@ -1,6 +1,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <xil_printf.h>
+#include <xparameters.h>
+#include <xtmrctr.h>
 
 #define BUTTONS (*(unsigned volatile *)0x40000000)
 #define JA (*(unsigned volatile *)0x40001000)
@@ -21,39 +23,99 @@
 #define TIMER_2 (*(unsigned volatile *)0x4000B000)
 #define TIMER_3 (*(unsigned volatile *)0x4000C000)
 
+// Pin Map - every pin the robot uses, one line each
+// X(arg, name, port, bit, dir) generates name_OFFSET, name_MASK and name_PORT
+// constants, the DDR value for each port, and a build error if two pins share
+// a bit. Keep the port tags distinct from the register macros (JA, JB, ...)
+#define PIN_MAP(X, arg) \
+  X(arg, BTND,        PORT_BTN, 0, PIN_IN)  /* BTN[0] */ \
+  X(arg, BTNR,        PORT_BTN, 1, PIN_IN)  /* BTN[1] */ \
+  X(arg, BTNL,        PORT_BTN, 2, PIN_IN)  /* BTN[2] */ \
+  X(arg, BTNU,        PORT_BTN, 3, PIN_IN)  /* BTN[3] */ \
+  X(arg, L1_QUAD_ENC, PORT_JA,  0, PIN_IN)  /* Left phase A */ \
+  X(arg, R1_QUAD_ENC, PORT_JA,  1, PIN_IN)  /* Right phase A */ \
+  X(arg, L2_QUAD_ENC, PORT_JA,  2, PIN_IN)  /* Left phase B */ \
+  X(arg, R2_QUAD_ENC, PORT_JA,  3, PIN_IN)  /* Right phase B */ \
+  X(arg, FRONT_TRIG,  PORT_JB,  0, PIN_OUT) \
+  X(arg, LEFT_TRIG,   PORT_JB,  1, PIN_OUT) \
+  X(arg, LEFT_ECHO,   PORT_JB,  2, PIN_IN)  \
+  X(arg, FRONT_ECHO,  PORT_JB,  3, PIN_IN)  \
+  X(arg, L_PWM,       PORT_JC,  0, PIN_OUT) /* Driven by axi_timer_0 pwm0 */ \
+  X(arg, LEFT2,       PORT_JC,  1, PIN_OUT) \
+  X(arg, LEFT1,       PORT_JC,  2, PIN_OUT) \
+  X(arg, R_PWM,       PORT_JC,  3, PIN_OUT) /* Driven by axi_timer_1 pwm0 */ \
+  X(arg, RIGHT2,      PORT_JC,  4, PIN_OUT) \
+  X(arg, RIGHT1,      PORT_JC,  5, PIN_OUT)
+
+#define PIN_OFFSET_ENUM(arg, name, port, bit, dir) name##_OFFSET = (bit),
+#define PIN_MASK_ENUM(arg, name, port, bit, dir) name##_MASK = (1u << (bit)),
+#define PIN_PORT_ENUM(arg, name, port, bit, dir) name##_PORT = port,
+#define PIN_ON_PORT(p, port, bit) (((port) == (p)) ? (1ull << (bit)) : 0)
+#define PIN_SUM(p, name, port, bit, dir) + PIN_ON_PORT(p, port, bit)
+#define PIN_OR(p, name, port, bit, dir) | PIN_ON_PORT(p, port, bit)
+#define PIN_INPUT(p, name, port, bit, dir) | ((dir) == PIN_IN ? PIN_ON_PORT(p, port, bit) : 0)
+#define PIN_PORT_FREE_OF_CONFLICTS(p) ((0 PIN_MAP(PIN_SUM, p)) == (0 PIN_MAP(PIN_OR, p))) // A shared bit carries into the sum
+#define PIN_PORT_DDR(p) ((uint32_t)(0 PIN_MAP(PIN_INPUT, p))) // 1 = Input, 0 = Output
+
 // Memory Access Offsets - Buttons
-#define BTND_OFFSET 0 // BTN[0]
-#define BTNR_OFFSET 1 // BTN[1]
-#define BTNL_OFFSET 2 // BTN[2]
-#define BTNU_OFFSET 3 // BTN[3]
-
-// Memory Access Offsets - Motors
-#define L_PWM_OFFSET 0  // JC[0]
-#define LEFT2_OFFSET 1  // JC[1]
-#define LEFT1_OFFSET 2  // JC[2]
-#define R_PWM_OFFSET 3  // JC[3]
-#define RIGHT2_OFFSET 4 // JC[4]
-#define RIGHT1_OFFSET 5 // JC[5]
-
-// Memory Access Offsets - Quad Encs
-#define L1_QUAD_ENC_OFFSET 0 // JA[0]
-#define R1_QUAD_ENC_OFFSET 1 // JA[1]
+#define BTN_COUNT 4
+#define BTN_MASK ((1 << BTN_COUNT) - 1)
+
+// H-bridge direction pins on JC
+#define BRIDGE_DIR_MASK (LEFT1_MASK | LEFT2_MASK | RIGHT1_MASK | RIGHT2_MASK)
+#define BTN_SAMPLE_US 5000 // Debounce sample period, a level must hold for 4 samples
+#define BTN_LONG_US 1000000 // Held this long raises a long-press event
+
+// Hardware Timer Channels - configure_timers() numbering
+// AXI timers 0 and 1 are used as PWM pairs, so channels 0-3 are left to init_motor_pwm()
+#define L_PWM_TIMER_BASEADDR XPAR_XTMRCTR_0_BASEADDR // Channels 0 and 1
+#define R_PWM_TIMER_BASEADDR XPAR_XTMRCTR_1_BASEADDR // Channels 2 and 3
+#define FIRST_FREE_TIMER 4
+#define ECHO_CAPTURE_BASEADDR XPAR_XTMRCTR_2_BASEADDR // Channels 4 and 5, free for echo capture
+#define USS_FRONT_CAPTURE 0 // 1 once the front echo drives capturetrig0 (active high) and capturetrig1 (active low) of axi_timer_2
+#define TIMEBASE_BASEADDR XPAR_XTMRCTR_3_BASEADDR // Timer 0 of this device, channel 6, free running, see timebase_now()
+
 
 // Constants
 #define PWM_TOP 255
+#define PWM_TICK_SHIFT 5 // Timer ticks per duty step = 1 << PWM_TICK_SHIFT
+#define PWM_PERIOD_TICKS ((PWM_TOP + 1) << PWM_TICK_SHIFT) // 8192 ticks @ 100MHz = 12.2kHz
+#define TIMER_TICK_NS 10
+#define TICKS_PER_US 100
+#define CONTROL_RATE_HZ 1000 // Encoder PID, drift PID and duty updates run at this fixed rate
+#define CONTROL_PERIOD_TICKS (XPAR_XTMRCTR_3_CLOCK_FREQUENCY / CONTROL_RATE_HZ)
+#define CONTROL_LATE_TICKS (CONTROL_PERIOD_TICKS / 4) // A tick starting this far past its deadline counts as late
+#define ENC_SAMPLE_HZ 20000 // Encoder pins are sampled at this rate, see encoder_service()
+#define ENC_SAMPLE_TICKS (XPAR_XTMRCTR_3_CLOCK_FREQUENCY / ENC_SAMPLE_HZ)
+#define ENC_GAP_LIMIT (1 << 20) // Longer sample gaps are clamped for the missed-edge check
+#define GLITCH_M 3 // JA/JB pins are filtered over the last GLITCH_M samples
+#define GLITCH_N 2 // A pin changes once GLITCH_N of those samples agree on the new level
 #define INCREMENT 8
-#define QUAD_ENC_TOP 10000
 #define DUTY_MOTION_START 0X30
 #define DIST_THRESHOLD 13 //cm
-#define TIMEOUT_TICKS (DIST_THRESHOLD*58)
+#define ECHO_US_PER_CM 58 // Round trip of sound for 1cm of range
+#define TIMEOUT_TICKS CM_TO_ECHO_TICKS(DIST_THRESHOLD)
 #define PRE_TURN_CORR 8 //inches
 #define POST_TURN_CORR 8 //inches
-#define CNT_PER_REV 340
-#define CNT_PER_INCH 45
+#define CNT_PER_REV 1360 // 4x decoding, every edge of both phases
+#define CNT_PER_INCH 180
+// Encoder polarity, +1 or -1 so that both counts go up rolling forward. The
+// motors are mirror-mounted, so with both encoders wired the same way, A to
+// the phase A pin (JA0 left, JA1 right) and B to phase B (JA2, JA3), the
+// right wheel's phases run backwards. Set RIGHT_ENC_POLARITY to 1 if the
+// right encoder's A and B are swapped at the PMOD instead.
+#define LEFT_ENC_POLARITY 1
+#define RIGHT_ENC_POLARITY -1
 #define HW_TIME_PER_SEC 565001
 #define US_PER_TICK  1.77f
-#define USS_READ_INTERVAL 0.060f // 60ms delay (4m max range)
+#define USS_MAX_PERIOD_US 60000 // Longest ping cycle, long enough for 4m of range
+#define USS_MIN_PERIOD_US 10000 // Shortest ping cycle however close the walls are
+#define USS_GUARD_MIN_US 1000 // Quiet time after the last echo drops, at the least
+#define USS_TRIG_US 10 // Trigger pulse width
+#define USS_PHASE_US 1000 // Each sensor pings this long after the previous one, 0 fires them together
+#define USS_XTALK_WINDOW_US 300 // An echo ending this close to where an earlier ping came back heard that ping
 #define MED_FILT_WINDOW 5
+#define MED_FILT_NETWORK 0 // 1 takes window 5 medians with median5(), constant time but slower than the sorted window at -O0
 #define BASE_DUTY_CYCLE 0xBF
 #define KP_enc 0.1f
 #define KI_enc 0.05f
@@ -61,25 +123,117 @@
 #define KP_drift 0.0156f
 #define KI_drift 0.5199f
 #define KD_drift 0.0f
+#define PID_Q_BITS 12 // Fixed-point PID gains are Q12 (4096 = 1.0)
+#define PID_INPUT_LIMIT (1 << 16) // With gains below 2.0 every gain*input product stays under 2^29
+#define PID_OUT_MAX 0xFF
+#define KP_vel 0.5f // Inner wheel velocity loop, duty per 1/1024 count/tick of error
+#define KI_vel 0.05f
+#define KD_vel 0.0f
+#define VEL_WINDOW_SHIFT 4 // Wheel velocity is measured over 2^VEL_WINDOW_SHIFT control ticks
+#define VEL_WINDOW (1 << VEL_WINDOW_SHIFT)
+#define QUAD_EDGES 4 // Edge timing spans one full quadrature cycle, evening out phase offset errors
+#define VEL_EDGE_MAX_COUNTS (4 * VEL_WINDOW) // Below 4 counts/tick wheel speed comes from edge timing
+#define VEL_RECIP_BITS 6 // Edge spans are looked up by their top 6 bits, under 1% error
+#define VEL_RECIP_SIZE (1 << VEL_RECIP_BITS)
+#define VEL_EDGE_NUM ((uint64_t)(QUAD_EDGES * CONTROL_PERIOD_TICKS) << PROFILE_Q_BITS) // Velocity = NUM / span
+#define VEL_STALL_TICKS (XPAR_XTMRCTR_3_CLOCK_FREQUENCY / 10) // No edge for 100ms reads as stopped
+#define VEL_ERR_SHIFT 10 // Inner loop error is in 1/1024 counts per tick
+#define POS_TO_VEL_GAIN 128 // Outer position loop, Q16 counts/tick per count of error (~0.002)
+#define HEADING_TO_VEL_SHIFT 8 // Heading PID output (+-PID_OUT_MAX) to Q16 counts/tick
+#define PROFILE_Q_BITS 16 // Profile velocities are counts per control tick in Q16
+#define STRAIGHT_CRUISE_CPS (12*CNT_PER_INCH) // Counts per second
+#define STRAIGHT_ACCEL_CPS2 (24*CNT_PER_INCH) // Counts per second^2
+#define STRAIGHT_DECEL_CPS2 (24*CNT_PER_INCH)
+#define TURN_CRUISE_CPS (8*CNT_PER_INCH)
+#define TURN_ACCEL_CPS2 (16*CNT_PER_INCH)
+#define TURN_DECEL_CPS2 (16*CNT_PER_INCH)
+#define PROFILE_MIN_VEL CPS_TO_VEL_Q(CNT_PER_INCH) // Creep speed so the profile always reaches its target
+#define PROFILE_OPEN_TARGET 0xFFFF // Target for profiles that never brake or finish, see profile_step()
+#define FF_DUTY_MIN 0xA0 // Roughly where the motors start to turn
+#define FF_VEL_SHIFT 12 // Uncalibrated feed-forward duty above FF_DUTY_MIN = velocity >> FF_VEL_SHIFT
+#define FF_LUT_SHIFT 14 // Feed-forward table entries are 2^FF_LUT_SHIFT Q16 counts/tick apart
+#define FF_LUT_SIZE 17 // Entry k is the duty for velocity k << FF_LUT_SHIFT, covers 0 to ~4000 counts/s
+#define FF_CAL_POINTS 16 // Duties measured by the calibration sweep
+#define FF_CAL_DUTY_SHIFT 4 // Sweep duty for point p is (p << FF_CAL_DUTY_SHIFT) | 0x0F
+#define FF_CAL_SETTLE_US 300000 // Let the wheel reach speed before counting
+#define FF_CAL_WINDOW_SHIFT 8 // Count over 2^FF_CAL_WINDOW_SHIFT control periods
+#define BRAKE_STOP_VEL CPS_TO_VEL_Q(CNT_PER_INCH/2) // A wheel slower than this counts as stopped
+#define BRAKE_DUTY_MIN 0x80 // Reverse duty at the slowest braking speed
+#define BRAKE_VEL_SHIFT 10 // Reverse duty above BRAKE_DUTY_MIN = velocity >> BRAKE_VEL_SHIFT
+#define BRAKE_TARGET_CNT (2*CNT_PER_INCH) // Past this many counts the brake goes to full reverse
+#define BRAKE_TIMEOUT_TICKS (CONTROL_RATE_HZ/2)
 #define LEFT_DIST_SETPOINT 9 //cm
 #define PI 3.141592653589793
+#define WHEEL_BASE_INCH 6.625
+#define WHEEL_HALF_BASE_Q8 ((uint32_t)(WHEEL_BASE_INCH/2 * 256 + 0.5)) // Inches in Q8
+#define ARC_Q_BITS 16
+#define ARC_CNT_PER_DEG_INCH_Q ((uint32_t)(PI/180*CNT_PER_INCH * (1 << ARC_Q_BITS) + 0.5)) // Arc counts per degree per inch of radius
+#define ARC_RADIUS_INCH PRE_TURN_CORR // Exits the corner where PRE/POST_TURN_CORR and a pivot would
+#define ARC_CRUISE_CPS STRAIGHT_CRUISE_CPS // Outer wheel speed through a curved turn
+#define MOTION_RATIO_ONE (1 << PROFILE_Q_BITS) // Wheel follows the profile unscaled
+#define VEL_RECIP(m) (uint32_t)((VEL_EDGE_NUM << 1) / (2*(m) + 1)), // NUM over the middle of [m, m+1)
+#define VEL_RECIP_4(m) VEL_RECIP(m) VEL_RECIP((m)+1) VEL_RECIP((m)+2) VEL_RECIP((m)+3)
+#define VEL_RECIP_16(m) VEL_RECIP_4(m) VEL_RECIP_4((m)+4) VEL_RECIP_4((m)+8) VEL_RECIP_4((m)+12)
+#define VEL_RECIP_64(m) VEL_RECIP_16(m) VEL_RECIP_16((m)+16) VEL_RECIP_16((m)+32) VEL_RECIP_16((m)+48)
+#define FF_CAL_DUTY(p) (((p) << FF_CAL_DUTY_SHIFT) | ((1 << FF_CAL_DUTY_SHIFT) - 1))
+#define FF_DEFAULT_DUTY(k) (FF_DUTY_MIN + (((k) << FF_LUT_SHIFT) >> FF_VEL_SHIFT)) // Linear model used until calibrated
+#define FF_DEFAULT_LUT {FF_DEFAULT_DUTY(0), FF_DEFAULT_DUTY(1), FF_DEFAULT_DUTY(2), FF_DEFAULT_DUTY(3), \
+                        FF_DEFAULT_DUTY(4), FF_DEFAULT_DUTY(5), FF_DEFAULT_DUTY(6), FF_DEFAULT_DUTY(7), \
+                        FF_DEFAULT_DUTY(8), FF_DEFAULT_DUTY(9), FF_DEFAULT_DUTY(10), FF_DEFAULT_DUTY(11), \
+                        FF_DEFAULT_DUTY(12), FF_DEFAULT_DUTY(13), FF_DEFAULT_DUTY(14), FF_DEFAULT_DUTY(15), \
+                        FF_DEFAULT_DUTY(16)}
 #define ITP (uint32_t *)
+#if VEL_RECIP_SIZE != 64
+#error "VEL_EDGE_RECIP is built with VEL_RECIP_64(), resize both together"
+#endif
+#if (GLITCH_M > 7) || (2*GLITCH_N <= GLITCH_M)
+#error "Glitch filter needs GLITCH_M <= 7 (3 bit counters) and a strict majority GLITCH_N"
+#endif
+#define US_TO_TICKS(us) ((uint32_t)(us) * TICKS_PER_US) // Only use on constants
+#define CM_TO_ECHO_TICKS(cm) US_TO_TICKS((cm) * ECHO_US_PER_CM) // Only use on constants
+#define TO_Q(x) ((int32_t)((x) * (1 << PID_Q_BITS) + 0.5f)) // Only use on constants, folds at compile time
+#define CPS_TO_VEL_Q(cps) ((uint32_t)(((uint64_t)(cps) << PROFILE_Q_BITS) / CONTROL_RATE_HZ))
+#define CPS2_TO_ACC_Q(cps2) ((uint32_t)(((uint64_t)(cps2) << PROFILE_Q_BITS) / ((uint64_t)CONTROL_RATE_HZ*CONTROL_RATE_HZ)))
 
 const volatile uint32_t TCSR_OFFEST = 0;
 const volatile uint32_t TLR_OFFEST = 1;
 const volatile uint32_t TCR_OFFSET = 2;
 
 // Addresses for all the timers, ITP casts the int to uint32_t ptr
-const uint32_t *TIMERS[] = {ITP 0x40009000, ITP 0x40009100, ITP 0x4000A000, ITP 0x4000A100,
-                            ITP 0x4000B000, ITP 0x4000B100, ITP 0x4000C000, ITP 0x4000C100};
+const uint32_t *TIMERS[] = {ITP 0x40009000, ITP 0x40009010, ITP 0x4000A000, ITP 0x4000A010,
+                            ITP 0x4000B000, ITP 0x4000B010, ITP 0x4000C000, ITP 0x4000C010};
 
 // Type definitions
+typedef enum {
+  PORT_BTN,
+  PORT_JA,
+  PORT_JB,
+  PORT_JC,
+} pin_port;
+
+typedef enum {
+  PIN_IN,
+  PIN_OUT,
+} pin_dir;
+
+// Pin constants, all folded at compile time
+enum {PIN_MAP(PIN_OFFSET_ENUM, 0)};
+enum {PIN_MAP(PIN_MASK_ENUM, 0)};
+enum {PIN_MAP(PIN_PORT_ENUM, 0)};
+
+_Static_assert(PIN_PORT_FREE_OF_CONFLICTS(PORT_BTN), "Two pins share a BUTTONS bit");
+_Static_assert(PIN_PORT_FREE_OF_CONFLICTS(PORT_JA), "Two pins share a JA bit");
+_Static_assert(PIN_PORT_FREE_OF_CONFLICTS(PORT_JB), "Two pins share a JB bit");
+_Static_assert(PIN_PORT_FREE_OF_CONFLICTS(PORT_JC), "Two pins share a JC bit");
+
 typedef enum {
   left,
   right,
   straight,
   stop,
   idle,
+  reverse,
+  motion_type_count,
 } motion_type;
 
 typedef enum {
@@ -95,31 +249,217 @@ typedef enum {
   turn_state,
   pause_half_sec,
   win,
+  calibrate,
 } maze_state;
 
 typedef enum {
   init_drive,
   driving,
-  stop_driving
+  stop_driving,
+  brake_driving
 } drive_state;
 
+typedef enum {
+  turn_brake,
+  turn_begin,
+  turn_pivot,
+  turn_post_corr,
+  turn_end,
+  turn_arc,
+  turn_arc_exit
+} turn_phase;
+
 typedef enum {
   send_trig,  
-  clear_trig,
   count_echo_duration, 
   median_filter,
   calculate_distance, 
   cooldown
   } uss_state;
 
+typedef enum {
+  uss_front,
+  uss_left,
+  uss_count,
+} uss_id;
+
+typedef struct {
+  int32_t kp;         // Gains in Q(PID_Q_BITS), must be non-negative
+  int32_t ki;
+  int32_t kd;
+  int32_t error_sum;
+  int32_t error_prev;
+} PidQ;
+
+typedef struct {
+  uint32_t next_deadline; // Timebase tick the next control update is due at
+  uint32_t tick_count;    // Control updates run
+  uint32_t late_ticks;    // Updates that started more than CONTROL_LATE_TICKS after their deadline
+  uint32_t missed_ticks;  // Whole periods dropped because the loop was stalled
+  _Bool run_cascade;       // Wheels follow g_Profile through the velocity/position cascade
+  _Bool run_enc_pid;       // Outer loops feeding the cascade
+  _Bool run_drift_pid;
+  _Bool run_position_hold;
+  _Bool run_brake;         // Reverse drive against the wheel speed until stopped, see run_brake()
+  _Bool run_duty_update;  // Cleared by motions that drive the PWM themselves
+} ControlScheduler;
+
+typedef struct {
+  uint32_t target_q; // Total distance, counts in Q16
+  uint32_t pos_q;    // Position setpoint, counts in Q16
+  uint32_t vel_q;    // Velocity setpoint, counts per control tick in Q16
+  uint32_t cruise_q;
+  uint32_t accel_q;  // Velocity change per control tick
+  uint32_t decel_q;
+  _Bool open;        // Started with PROFILE_OPEN_TARGET
+  _Bool done;
+} VelocityProfile;
+
+typedef struct {
+  uint32_t count;    // 4x count, rolling forward counts up, never reset and free to wrap
+  uint32_t travel;   // Counts along the commanded direction, never reset and free to wrap
+  uint32_t distance; // Counts moved in either direction over the whole run
+  uint32_t illegal;  // Transitions where both phases changed between samples
+  int8_t dir;        // Commanded direction, +1 forward, -1 reverse, set by set_motion_type()
+  int8_t polarity;   // LEFT/RIGHT_ENC_POLARITY, -1 for phases that run backwards rolling forward
+  uint8_t last_ab;   // Phase A in bit 1, phase B in bit 0
+  uint32_t a_mask;   // JA pins, from the pin map
+  uint32_t b_mask;
+  uint32_t edge_time[QUAD_EDGES]; // Timebase stamps of the last QUAD_EDGES edges
+  uint32_t edge_span; // Ticks the last QUAD_EDGES edges took
+  uint8_t edge_index;
+  uint8_t edge_run;  // Edges in a row in edge_dir, saturates once edge_span is valid
+  int8_t edge_dir;   // Direction of the last edge in the forward frame
+} QuadEncoder;
+
+typedef struct {
+  uint32_t left;  // Encoder travel when the segment was marked, see odo_mark()
+  uint32_t right;
+} OdoMark;
+
+typedef struct {
+  QuadEncoder * enc;
+  uint32_t history[VEL_WINDOW]; // Encoder count at each of the last VEL_WINDOW ticks
+  uint8_t index;
+  int32_t vel_q;                // Measured velocity, positive forward, counts per control tick in Q16
+  PidQ pid;                     // Inner velocity loop
+  uint8_t ff_lut[FF_LUT_SIZE];  // Feed-forward duty by velocity, see ff_duty()
+} WheelVelocity;
+
+typedef struct {
+  uint32_t left_vel_q[FF_CAL_POINTS]; // Measured speed at each sweep duty, Q16 counts per control tick
+  uint32_t right_vel_q[FF_CAL_POINTS];
+  uint32_t start_left;  // Encoder counts when the measure window opened
+  uint32_t start_right;
+  uint32_t step_start;  // Timebase stamp the current settle or measure phase began at
+  uint8_t point;
+  _Bool measuring;
+} FfCalibration;
+
+typedef struct {
+  uint32_t start_left;  // Encoder counts when braking began
+  uint32_t start_right;
+  uint32_t start_tick;  // g_Control.tick_count when braking began
+} BrakeTask;
+
+typedef struct {
+  uint32_t target_left;   // Encoder count each wheel drives to
+  uint32_t target_right;
+  uint32_t left_ratio_q;  // Share of the profile each wheel follows, Q16
+  uint32_t right_ratio_q;
+  _Bool active;
+} MotionTask;
+
+typedef struct {
+  XTmrCtr timer;        // AXI timer pair running in PWM mode
+  uint8_t applied_duty; // Duty currently loaded into the timer
+} PwmChannel;
+
+typedef struct {
+  uint32_t next_deadline;  // Timebase tick the next encoder sample is due at
+  uint32_t last_sample;    // Timebase stamp of the previous sample
+  uint32_t worst_interval; // Longest gap between samples since the last control tick
+  uint32_t samples;
+  uint32_t missed_edges;   // Control ticks where a gap was longer than one encoder state at the measured speed
+} EncoderSampler;
+
 typedef struct {
-  uint8_t trig_offset;
-  uint8_t echo_offset; 
-  uint8_t hw_timer_channel;
-  uint32_t raw_echo_high_time;
+  uint32_t history[GLITCH_M]; // Last GLITCH_M raw samples of the port
+  uint8_t index;
+  uint32_t out;               // Filtered port image
+} PinFilter;
+
+typedef struct {
+  uint8_t pressed;    // One bit per button, BTN[n] is bit n
+  uint8_t released;
+  uint8_t long_press;
+} ButtonEvents;
+
+typedef struct {
+  uint32_t next_deadline;         // Timebase tick the next debounce sample is due at
+  uint8_t cnt0;                   // Vertical 2 bit counters, one bit per button
+  uint8_t cnt1;
+  uint8_t state;                  // Debounced levels
+  uint8_t long_sent;              // Held buttons that already raised a long-press
+  uint32_t press_start[BTN_COUNT]; // Timebase stamp each held button went down
+  ButtonEvents events;            // Collected until button_take_events()
+} ButtonService;
+
+typedef struct {
+  uint32_t buttons; // Latched once per main loop pass by process_image_latch()
+} InputImage;
+
+typedef struct {
+  uint32_t jc;      // Written out once per pass by process_image_flush()
+  uint32_t leds;
+  uint32_t seven_seg;
+  uint32_t anodes;
+} OutputImage;
+
+typedef struct {
+  uint8_t jc;         // Direction pin levels, applied under BRIDGE_DIR_MASK
+  int8_t left_dir;    // Encoder direction, 0 leaves it as it was
+  int8_t right_dir;
+} BridgeSetting;
+
+typedef struct {
+  uint32_t trig_mask; // JB pins, from the pin map
+  uint32_t echo_mask;
+  XTmrCtr * capture;  // Timer latching both echo edges, NULL has encoder_service() stamp them
+  uint32_t trig_time; // Timebase stamp of this sensor's ping this scan
+  uint32_t rise_time; // Echo edge stamps this scan, 100MHz ticks on the sensor's clock
+  uint32_t fall_time;
+  uint32_t capture_offset; // Timebase minus the capture clock, so captured stamps land on the timebase
+  uint32_t raw_echo_high_time; // 100MHz ticks, compare against CM_TO_ECHO_TICKS()
   uint32_t med_echo_high_time;
+  uint32_t buf[MED_FILT_WINDOW]; // Last MED_FILT_WINDOW raw readings
+  uint32_t sorted[MED_FILT_WINDOW]; // The same readings in order, see median_window_replace()
+  uint32_t dist;                 // Filtered distance, cm
 } UltrasonicSensor;
 
+typedef struct {
+  UltrasonicSensor * sensors;
+  uint8_t count;
+  uint32_t trig_mask;  // All sensors' pins, so every scan step is one port-wide operation
+  uint32_t echo_mask;
+  uint32_t capture_mask; // Echo pins timed by capture timers, the rest are sampled
+  uint32_t fired;      // Echo pins of the sensors that have pinged this scan
+  uint32_t armed;      // Sampled echo pins still waiting for an edge this scan
+  uint32_t last_echo;  // Sampled echo pins at the previous sample
+  uint32_t seen;       // Echo pins whose rising edge is stamped this scan
+  uint32_t fallen;     // Echo pins whose falling edge is stamped this scan
+  uint32_t done;       // Echo pins whose reading is in for this scan
+  uint32_t rejected;   // Echo pins whose reading this scan was crosstalk
+  uint32_t crosstalk;  // Readings rejected as crosstalk over the whole run
+  uint32_t trig_time;  // Timebase stamp of this scan's first trigger
+  uint32_t next_fire_time; // When sensor next_fire is due to ping
+  uint8_t next_fire;
+  uint32_t trig_high;  // Trig pins raised and not yet dropped
+  uint32_t pulse_start;
+  uint8_t buf_index;   // Median window slot, shared since every sensor is read each scan
+  uss_state state;
+} UssEngine;
+
 // Seven Segment Display LUT
 uint8_t sevenSegLUT[10] = {
     0xC0, // 0 --> 1100 0000
@@ -134,60 +474,166 @@ uint8_t sevenSegLUT[10] = {
     0x90, // 9 --> 1001 0000
 };
 
+// Quadrature transition LUT, indexed by (last AB << 2) | new AB
+// B leading A (AB 00 -> 01 -> 11 -> 10) counts up, before the wheel's polarity is applied
+#define QUAD_ILLEGAL 2
+const int8_t QUAD_STEP[16] = {
+     0,  1, -1, QUAD_ILLEGAL,
+    -1,  0, QUAD_ILLEGAL,  1,
+     1, QUAD_ILLEGAL,  0, -1,
+    QUAD_ILLEGAL, -1,  1,  0,
+};
+
+// Edge velocity reciprocal LUT, entry i is VEL_EDGE_NUM / (VEL_RECIP_SIZE + i + 1/2)
+// Built at compile time, see wheel_edge_velocity()
+const uint32_t VEL_EDGE_RECIP[VEL_RECIP_SIZE] = {VEL_RECIP_64(VEL_RECIP_SIZE)};
+
 // Function declarations - implemented below
 void init_program(); // One Time Initializations
 _Bool delay_1s();
 _Bool delay_5s();
 _Bool delay_half_sec();
 void timer_2us(unsigned t);
-static inline void set_trig_pin(UltrasonicSensor uss);
-static inline void clear_trig_pin(UltrasonicSensor uss);
-static inline _Bool read_echo_pin(UltrasonicSensor uss);
-void restart_timer0();
-uint32_t get_timer0_value_us();
+void uss_engine_init(UssEngine * uss, UltrasonicSensor * sensors, uint8_t count);
+void uss_engine_step(UssEngine * uss);
+void uss_echo_sample(UssEngine * uss, uint32_t jb, uint32_t now);
+void uss_trigger_service(UssEngine * uss);
+static inline _Bool uss_xtalk_pending(const UssEngine * uss, const UltrasonicSensor * s, uint32_t now);
+static inline _Bool uss_is_crosstalk(const UssEngine * uss, const UltrasonicSensor * s);
+static inline void uss_capture_arm(UltrasonicSensor * s);
+void uss_capture_poll(UssEngine * uss);
+_Bool uss_cooldown_done(UssEngine * uss);
 uint32_t *convert_timer_to_hex_address(uint8_t timer_number);
 void configure_timers();
-void start_stopwatch(uint8_t timer_number);
-uint32_t read_stopwatch(uint8_t timer_number);
+static inline uint32_t timebase_now();
+static inline uint32_t timebase_elapsed(uint32_t start);
+void init_control_scheduler();
+_Bool control_tick_due();
+void control_service();
 void show_sseg(uint8_t *sevenSegValue);
-_Bool UpButton_pressed();
-_Bool DownButton_pressed();
-_Bool LeftButton_pressed();
-_Bool RightButton_pressed();
-uint32_t read_L1_quad_enc(_Bool reset);
-uint32_t read_R1_quad_enc(_Bool reset);
+void process_image_latch();
+void process_image_flush();
+void process_image_flush_jc();
+static inline uint32_t pin_count_at_least(uint32_t c2, uint32_t c1, uint32_t c0, uint8_t n);
+uint32_t pin_filter_update(PinFilter * filter, uint32_t raw);
+void button_service();
+ButtonEvents button_take_events();
+static inline void quad_enc_update(QuadEncoder * enc, uint32_t pins, uint32_t now);
+void init_encoder_sampler();
+void encoder_service();
+static inline _Bool encoder_gap_too_long(uint32_t interval, int32_t vel_q);
+void encoder_check_gaps();
+static inline int32_t odo_delta(uint32_t now, uint32_t then);
+void odo_mark(OdoMark * mark);
+int32_t odo_left(const OdoMark * mark);
+int32_t odo_right(const OdoMark * mark);
 void set_motion_type(motion_type mode);
-static inline uint8_t scale_correction(int32_t raw_correction);
-void PID_Controller_enc(_Bool reset, uint32_t L1, uint32_t R1);
-void PID_Controller_drift(_Bool reset);
-void drive_straight_distance(uint32_t inches);
+void init_motor_pwm();
+static inline uint32_t pwm_duty_to_high_tlr(uint8_t duty);
+void set_wheel_duty(PwmChannel * pwm, uint8_t duty);
+void update_motor_pwm();
+static inline int32_t pid_q_mul(int32_t gain_q, int32_t x);
+static inline int32_t pid_q_clamp(int32_t x);
+void pid_q_reset(PidQ * pid);
+static int32_t pid_q_sum(PidQ * pid, int32_t error);
+int32_t pid_q_output(PidQ * pid, int32_t error);
+int32_t PID_Controller_enc(_Bool reset, int32_t L1, int32_t R1);
+int32_t PID_Controller_drift(_Bool reset);
+void profile_start(VelocityProfile * profile, uint32_t target_enc, 
+                   uint32_t cruise_q, uint32_t accel_q, uint32_t decel_q);
+void profile_step(VelocityProfile * profile);
+static inline uint8_t ff_duty(const uint8_t lut[FF_LUT_SIZE], uint32_t vel_q);
+void ff_build_lut(uint8_t lut[FF_LUT_SIZE], const uint32_t vel_q[FF_CAL_POINTS]);
+void ff_print_table(char wheel, const uint8_t lut[FF_LUT_SIZE], const uint32_t vel_q[FF_CAL_POINTS]);
+void ff_calibration_start();
+_Bool ff_calibration_step();
+void wheel_velocity_reset(WheelVelocity * wheel);
+static inline int32_t wheel_edge_velocity(const QuadEncoder * enc, uint32_t now);
+void wheel_velocity_sample(WheelVelocity * wheel);
+uint8_t wheel_velocity_loop(WheelVelocity * wheel, int32_t vel_ref);
+static inline uint32_t motion_scale(uint32_t x_q, uint32_t ratio_q);
+void run_cascade(int32_t L1, int32_t R1);
+uint8_t brake_wheel_duty(WheelVelocity * wheel, int32_t travelled);
+void run_brake();
+_Bool brake_is_done();
+void motion_start_distance(uint32_t inches);
+void motion_start_turn(uint32_t degrees);
+static inline uint32_t arc_counts(uint32_t radius_q8, uint32_t degrees);
+void motion_start_arc(uint32_t radius_inch, uint32_t degrees, motion_type dir);
+void motion_step();
+_Bool motion_is_done();
 void drive_straight(drive_state cmd);
-void turn(uint32_t degrees);
-void read_2_uss_fsm(UltrasonicSensor * uss1, 
-                    UltrasonicSensor * uss2, 
-                    // float * dist_1, 
-                    // float * dist_2,
-                    uint32_t buf1[MED_FILT_WINDOW],
-                    uint32_t buf2[MED_FILT_WINDOW]);
-void selection_sort(uint32_t intArray[], uint8_t arrayLength);
+static inline uint32_t echo_ticks_to_cm(uint32_t ticks);
+static inline uint32_t median_filter_push(UltrasonicSensor * s, uint8_t index, uint32_t sample);
+static inline uint32_t median5(const uint32_t window[5]);
+static inline void median_window_replace(uint32_t sorted[MED_FILT_WINDOW], uint32_t old, uint32_t sample);
+static inline void sort2(uint32_t * pFirst, uint32_t * pSecond);
 static inline void swap(uint32_t * pFirst, uint32_t * pSecond);
 void celebration();
 
 // Global Variables:
 uint8_t g_LeftDutyCycle = 0x00;
 uint8_t g_RightDutyCycle = 0x00;
-uint32_t g_FrontDist = 0;
-uint32_t g_LeftDist = 0;
 _Bool g_NewReading = false;
 
-// Median Filtering
-static uint32_t front_buf[MED_FILT_WINDOW] = {14, 14, 14, 14, 14};
-static uint32_t left_buf[MED_FILT_WINDOW] = {14, 14, 14, 14, 14};
-uint8_t buf_write_index = 0; // Used for both front and left, updated simultaneously
+// PID controllers, gains converted to fixed point at compile time
+// The drift loop has always run on the encoder gains, KP/KI/KD_drift are not tuned yet
+PidQ EncPid = {TO_Q(KP_enc), TO_Q(KI_enc), TO_Q(KD_enc), 0, 0};
+PidQ DriftPid = {TO_Q(KP_enc), TO_Q(KI_enc), TO_Q(KD_enc), 0, 0};
+
+// GPIO process image, inputs are read and outputs written once per pass
+InputImage g_In;
+OutputImage g_Out;
+
+// H-bridge direction pins and encoder directions for each motion_type
+// stop shorts both bridges (brake), idle lets both float (coast)
+const BridgeSetting BRIDGE_TABLE[motion_type_count] = {
+  [left]     = {LEFT2_MASK | RIGHT1_MASK, 1, -1},
+  [right]    = {LEFT1_MASK | RIGHT2_MASK, -1, 1},
+  [straight] = {LEFT2_MASK | RIGHT2_MASK, 1, 1},
+  [stop]     = {BRIDGE_DIR_MASK, 0, 0},
+  [idle]     = {0, 0, 0},
+  [reverse]  = {LEFT1_MASK | RIGHT1_MASK, -1, -1},
+};
 
-// Initialize Ultrasonic Sensors
-UltrasonicSensor FrontUSS = {0, 3, 3, 0, 0};
-UltrasonicSensor LeftUSS = {1, 2, 4, 0, 0};
+// Glitch filters for the encoder and echo ports, updated by encoder_service()
+PinFilter JaFilter;
+PinFilter JbFilter;
+
+// Debounced buttons
+ButtonService g_Buttons;
+
+// Quadrature decoders, both phases of each wheel on JA
+QuadEncoder LeftEnc = {0, 0, 0, 0, 1, LEFT_ENC_POLARITY, 0, L1_QUAD_ENC_MASK, L2_QUAD_ENC_MASK, {0}, 0, 0, 0, 0};
+QuadEncoder RightEnc = {0, 0, 0, 0, 1, RIGHT_ENC_POLARITY, 0, R1_QUAD_ENC_MASK, R2_QUAD_ENC_MASK, {0}, 0, 0, 0, 0};
+OdoMark g_Segment; // Start of the current motion task
+EncoderSampler g_EncSampler;
+
+// Per wheel speed measurement and inner velocity loop
+WheelVelocity LeftWheel = {&LeftEnc, {0}, 0, 0, {TO_Q(KP_vel), TO_Q(KI_vel), TO_Q(KD_vel), 0, 0}, FF_DEFAULT_LUT};
+WheelVelocity RightWheel = {&RightEnc, {0}, 0, 0, {TO_Q(KP_vel), TO_Q(KI_vel), TO_Q(KD_vel), 0, 0}, FF_DEFAULT_LUT};
+FfCalibration g_FfCal;
+
+// Resumable straight/turn motion, stepped from the main loop
+MotionTask g_Motion;
+VelocityProfile g_Profile;
+BrakeTask g_Brake;
+
+// Fixed rate control loop
+ControlScheduler g_Control;
+
+// Hardware PWM for each wheel
+PwmChannel LeftPwm;
+PwmChannel RightPwm;
+
+// Ultrasonic Sensors, scanned together by g_UssEngine
+XTmrCtr FrontEchoCapture;
+UltrasonicSensor g_Uss[uss_count] = {
+  [uss_front] = {.trig_mask = FRONT_TRIG_MASK, .echo_mask = FRONT_ECHO_MASK,
+                 .capture = USS_FRONT_CAPTURE ? &FrontEchoCapture : NULL},
+  [uss_left]  = {.trig_mask = LEFT_TRIG_MASK, .echo_mask = LEFT_ECHO_MASK, .capture = NULL},
+};
+UssEngine g_UssEngine;
 
 // ###########################################################################################################
 
@@ -197,46 +643,64 @@ int main() {
 
   // set up PMOD DDRs
   // 1 = Input, 0 = Output
-  JA_DDR = 0x03;
-  JB_DDR = 0x00;
-  JB_DDR |= ((1<<FrontUSS.echo_offset) | (1<<LeftUSS.echo_offset));
-  JC_DDR = 0x00;
+  JA_DDR = PIN_PORT_DDR(PORT_JA);
+  JB_DDR = PIN_PORT_DDR(PORT_JB);
+  JC_DDR = PIN_PORT_DDR(PORT_JC);
 
-  ANODES = 0xE;
+  g_Out.anodes = 0xE;
   _Bool btnU = false, btnD = false, btnL = false, btnR = false;
+  ButtonEvents btn;
   maze_state state = wait_to_start;
   maze_state next_state;
   maze_state ultrasonic_state = left_only;
   maze_state last_ultrasonic = left_only;
   motion_type turn_dir;
+  turn_phase turn_step = turn_begin;
   uint8_t win_check = 0;
+  _Bool win_reported = false;
   uint8_t obstacle_cnt = 0;
+  uint32_t state_start = 0; // Timebase stamp for the delay states
 
   while (1) {  
     next_state = state; // Ensure we never accidentally leave state without checking
-    btnU = UpButton_pressed();
-    btnD = DownButton_pressed();
-    btnL = LeftButton_pressed();
-    btnR = RightButton_pressed();
+    encoder_service();
+    process_image_latch();
+    button_service();
+    btn = button_take_events();
+    btnU = btn.pressed & BTNU_MASK;
+    btnD = btn.pressed & BTND_MASK;
+    btnL = btn.pressed & BTNL_MASK;
+    btnR = btn.pressed & BTNR_MASK;
     g_NewReading = false; // Reset new reading flag so that it will only be high if uss fsm sets it
-    read_2_uss_fsm(&FrontUSS, &LeftUSS, 
-                   front_buf, left_buf);
+    uss_engine_step(&g_UssEngine);
+    control_service();
     if (g_NewReading) {          
-      if (g_FrontDist >= DIST_THRESHOLD && g_LeftDist < DIST_THRESHOLD) {ultrasonic_state = left_only;}
-      else if (g_FrontDist < DIST_THRESHOLD && g_LeftDist < DIST_THRESHOLD) {ultrasonic_state = left_and_front;}
-      else if (g_FrontDist < DIST_THRESHOLD && g_LeftDist >= DIST_THRESHOLD) {ultrasonic_state = front_only;}
-      else if (g_FrontDist >= DIST_THRESHOLD && g_LeftDist >= DIST_THRESHOLD) {ultrasonic_state = no_left_or_front;}
+      _Bool front_open = g_Uss[uss_front].med_echo_high_time >= CM_TO_ECHO_TICKS(DIST_THRESHOLD);
+      _Bool left_open = g_Uss[uss_left].med_echo_high_time >= CM_TO_ECHO_TICKS(DIST_THRESHOLD);
+      if (front_open && !left_open) {ultrasonic_state = left_only;}
+      else if (!front_open && !left_open) {ultrasonic_state = left_and_front;}
+      else if (!front_open && left_open) {ultrasonic_state = front_only;}
+      else {ultrasonic_state = no_left_or_front;}
     }
     switch (state) {
     case wait_to_start:
       if (btnU) {
         next_state = delay_3s;
-        start_stopwatch(6);
+        state_start = timebase_now();
+      }
+      else if (btnL) {
+        ff_calibration_start();
+        next_state = calibrate;
       }
       break;
 
+    case calibrate:
+      // Run with the wheels off the ground, prints the tables when done
+      if (ff_calibration_step()) {next_state = wait_to_start;}
+      break;
+
     case delay_3s:
-      if (read_stopwatch(6) >= 3000000) {next_state = initialize_drive;}
+      if (timebase_elapsed(state_start) >= US_TO_TICKS(3000000)) {next_state = initialize_drive;}
       break;
 
     case update_uss:
@@ -255,66 +719,111 @@ int main() {
       drive_straight(driving);
       if (g_NewReading && (ultrasonic_state != last_ultrasonic)) {next_state = update_uss;}
       
-      PID_Controller_drift(0);   
+      g_Control.run_drift_pid = true; // Runs from control_service()
 
       break;
     
     case left_and_front:
       win_check++;
-      drive_straight(stop_driving);
-      set_motion_type(stop);
+      drive_straight(brake_driving);
       turn_dir = right;
+      turn_step = turn_brake;
       next_state = turn_state;
       obstacle_cnt++;
       break;
 
     case front_only:
       win_check = 0;
-      drive_straight(stop_driving);
-      set_motion_type(stop);
+      drive_straight(brake_driving);
       turn_dir = right;
+      turn_step = turn_brake;
       next_state = turn_state;
       obstacle_cnt++;
       break;
 
     case no_left_or_front:
       win_check = 0;
-      drive_straight(stop_driving);
-      set_motion_type(stop);
       turn_dir = left;
+      turn_step = turn_arc; // Curve through the opening without stopping
       next_state = turn_state;
       break;
     
     case turn_state:
-       if (turn_dir == left) {
-        set_motion_type(straight);
-        drive_straight_distance(PRE_TURN_CORR);
+      // Each phase is a motion task stepped once per pass, so the ultrasonic
+      // FSM, buttons and display keep running for the whole turn
+      if (!motion_is_done()) {
+        motion_step();
+        break;
       }
-      
-      set_motion_type(turn_dir);
-      turn(90);
 
-      if (turn_dir == left) {
-        set_motion_type(straight);
-        drive_straight_distance(POST_TURN_CORR);
+      switch (turn_step) {
+        case turn_brake:
+          if (brake_is_done()) {turn_step = turn_begin;}
+          break;
+
+        case turn_begin:
+          if (turn_dir == left) {
+            set_motion_type(straight);
+            motion_start_distance(PRE_TURN_CORR);
+          }
+          turn_step = turn_pivot;
+          break;
+
+        case turn_pivot:
+          set_motion_type(turn_dir);
+          motion_start_turn(90);
+          turn_step = turn_post_corr;
+          break;
+
+        case turn_post_corr:
+          if (turn_dir == left) {
+            set_motion_type(straight);
+            motion_start_distance(POST_TURN_CORR);
+          }
+          turn_step = turn_end;
+          break;
+
+        case turn_end:
+          state_start = timebase_now();
+          next_state = pause_half_sec;
+          break;
+
+        case turn_arc:
+          set_motion_type(straight);
+          motion_start_arc(ARC_RADIUS_INCH, 90, turn_dir);
+          turn_step = turn_arc_exit;
+          break;
+
+        case turn_arc_exit:
+          next_state = initialize_drive; // Still moving, drive_straight() carries the speed
+          break;
       }
-
-      start_stopwatch(6);
-      next_state = pause_half_sec;
       break;
 
     case pause_half_sec:
       set_motion_type(stop);
-      if (read_stopwatch(6) >= 500000) {
+      if (timebase_elapsed(state_start) >= US_TO_TICKS(500000)) {
         next_state = initialize_drive;
       }
       break;
       
     case win:
+      // The brake started on the way in has to finish before anything blocks
+      if (!brake_is_done()) break;
       set_motion_type(stop);
+      if (!win_reported) {
+        xil_printf("Control ticks: %d late: %d missed: %d\r\n", 
+                   g_Control.tick_count, g_Control.late_ticks, g_Control.missed_ticks);
+        xil_printf("Encoder illegal transitions L: %d R: %d missed edges: %d\r\n", 
+                   LeftEnc.illegal, RightEnc.illegal, g_EncSampler.missed_edges);
+        xil_printf("Odometry total counts L: %d R: %d\r\n", LeftEnc.distance, RightEnc.distance);
+        xil_printf("USS crosstalk rejected: %d\r\n", g_UssEngine.crosstalk);
+        win_reported = true;
+      }
       celebration();
       if (btnD) {
         win_check = 0;
+        win_reported = false;
         next_state = wait_to_start;
       }
       break;
@@ -323,10 +832,9 @@ int main() {
       next_state = initialize_drive;
       break;
     }
-    SEVEN_SEG = sevenSegLUT[obstacle_cnt];
-    if (win_check == 2) {
-      next_state = win;
-    }
+    g_Out.seven_seg = sevenSegLUT[obstacle_cnt];
+    if (win_check == 2) {next_state = win;}
+    process_image_flush();
     state = next_state;
   }
 }
@@ -336,23 +844,13 @@ int main() {
 // Functions Initialization
 void init_program() { 
   configure_timers();
+  init_motor_pwm();
+  init_control_scheduler();
+  init_encoder_sampler();
+  uss_engine_init(&g_UssEngine, g_Uss, uss_count);
   set_motion_type(straight);
 }
 
-// Functions for the Ultrasonic Sensor
-static inline void set_trig_pin(UltrasonicSensor uss) {
-  JB |= (1<<uss.trig_offset); // set trig pin
-}
-
-static inline void clear_trig_pin(UltrasonicSensor uss) {
-  JB &= ~(1<<uss.trig_offset); // clear trig pin
-}
-
-static inline _Bool read_echo_pin(UltrasonicSensor uss) {
-  bool echo = JB & (1<<uss.echo_offset); // Read echo signal from pin
-  return echo;           // return echo pin value
-}
-
 // Function Implementation - Software Delays
 _Bool delay_1s() {
   const uint32_t TOP = 2870000;
@@ -395,34 +893,19 @@ void timer_2us(unsigned t) {
 }
 
 // Function implementation - Hardware Timers
-void restart_timer0() {
-  // TCSR0 &= ~(1<<7);
-  // TCSR0 |= 1<<5;
-  // TCSR0 &= ~(1<<5);
-  // TCSR0 |= (1<<7);
-  start_stopwatch(0);
-}
-
-uint32_t get_timer0_value_us() {
-  // uint32_t count = TCR0;
-  // TCSR0 |= 1<<8;
-  // uint32_t time_us = count/100;
-  // return time_us;
-  return read_stopwatch(0);
-}
-
 uint32_t *convert_timer_to_hex_address(uint8_t timer_number) {
   if (timer_number > 7)
     return 0;
   uint32_t *timer_base_address =
       (uint32_t *)0x40009000 + ((timer_number / 2) * 0x0400);
   if (timer_number & 1)
-    timer_base_address += 0x40;
+    timer_base_address += XTC_TIMER_COUNTER_OFFSET / 4; // Timer 1 registers are 0x10 bytes after timer 0
   return timer_base_address;
 }
 
 void configure_timers() {
-  for (int i = 0; i < 8; i++) {
+  // Channels below FIRST_FREE_TIMER belong to the PWM timers, see init_motor_pwm()
+  for (int i = FIRST_FREE_TIMER; i < 8; i++) {
     uint32_t *timer_base_address = convert_timer_to_hex_address(i);
     uint32_t *tcr = timer_base_address + TCR_OFFSET;
     uint32_t *tcsr = timer_base_address + TCSR_OFFEST;
@@ -431,468 +914,1270 @@ void configure_timers() {
   }
 }
 
-void start_stopwatch(uint8_t timer_number) {
-  if (timer_number > 7)
-    return;
-  uint32_t *timer_base_address = convert_timer_to_hex_address(timer_number);
-  volatile uint32_t *tcsr = timer_base_address + TCSR_OFFEST;
-  *tcsr &= ~(1 << 7);
-  *tcsr |= 1 << 5;
-  *tcsr &= ~(1 << 5);
-  *tcsr |= 1 << 7;
+// Free running timebase - raw 100MHz ticks, wraps every ~42s.
+// Differences between two stamps are wrap safe as long as they are < 2^32 ticks.
+static inline uint32_t timebase_now() {
+  return XTmrCtr_GetTimerCounterReg(TIMEBASE_BASEADDR, XTC_TIMER_0);
 }
 
-uint32_t read_stopwatch(uint8_t timer_number) {
-  if (timer_number > 7)
-    return 0;
-  uint32_t *timer_base_address = convert_timer_to_hex_address(timer_number);
-  volatile uint32_t *tcr = timer_base_address + TCR_OFFSET;
-  return (*tcr) / 100;
+static inline uint32_t timebase_elapsed(uint32_t start) {
+  return timebase_now() - start;
+}
+
+// Function implementation - Control Scheduler
+// Controller work is deadline driven from the timebase so the PID sample time
+// stays at CONTROL_PERIOD_TICKS no matter how long a main loop pass takes.
+void init_control_scheduler() {
+  g_Control.next_deadline = timebase_now() + CONTROL_PERIOD_TICKS;
+  g_Control.tick_count = 0;
+  g_Control.late_ticks = 0;
+  g_Control.missed_ticks = 0;
+  g_Control.run_cascade = false;
+  g_Control.run_enc_pid = false;
+  g_Control.run_drift_pid = false;
+  g_Control.run_position_hold = false;
+  g_Control.run_brake = false;
+  g_Control.run_duty_update = false;
+}
+
+_Bool control_tick_due() {
+  int32_t lateness = (int32_t)(timebase_now() - g_Control.next_deadline);
+  if (lateness < 0) return false;
+
+  g_Control.next_deadline += CONTROL_PERIOD_TICKS;
+  if (lateness >= CONTROL_PERIOD_TICKS) {
+    // Stalled for whole periods, drop them rather than running a burst of catch-up updates
+    while (lateness >= CONTROL_PERIOD_TICKS) {
+      lateness -= CONTROL_PERIOD_TICKS;
+      g_Control.next_deadline += CONTROL_PERIOD_TICKS;
+      g_Control.missed_ticks++;
+    }
+  }
+  else if (lateness > CONTROL_LATE_TICKS) {
+    g_Control.late_ticks++;
+  }
+  g_Control.tick_count++;
+  return true;
+}
+
+// Call once per loop pass. Encoders are polled every pass so no edges are lost,
+// everything else only runs when a control tick is due.
+void control_service() {
+  encoder_service();
+  int32_t L1 = odo_left(&g_Segment);
+  int32_t R1 = odo_right(&g_Segment);
+  if (!control_tick_due()) return;
+
+  wheel_velocity_sample(&LeftWheel);
+  wheel_velocity_sample(&RightWheel);
+  encoder_check_gaps();
+  if (g_Control.run_cascade) {run_cascade(L1, R1);}
+  if (g_Control.run_brake) {run_brake();}
+  if (g_Control.run_duty_update) {update_motor_pwm();}
 }
 
 // Function implementation - SSeg
 void show_sseg(uint8_t *sevenSegValue) {
   static uint8_t anodeCnt = 0;
-  if (read_stopwatch(1) > 1000) {
+  static uint32_t last_digit = 0;
+  if (timebase_elapsed(last_digit) > US_TO_TICKS(1000)) {
     anodeCnt++;
-    ANODES = ~(1 << (anodeCnt % 4));
-    SEVEN_SEG = sevenSegValue[anodeCnt % 4];
-    start_stopwatch(1);
+    g_Out.anodes = ~(1 << (anodeCnt % 4));
+    g_Out.seven_seg = sevenSegValue[anodeCnt % 4];
+    last_digit = timebase_now();
   }
 }
 
-// Function implementation - Buttons
-_Bool UpButton_pressed() {
-  static _Bool current_upbtn_value = 0, previous_upbtn_value = 0;
-  previous_upbtn_value = current_upbtn_value;
-  current_upbtn_value = BUTTONS & (1 << BTNU_OFFSET);
-  return (current_upbtn_value && !previous_upbtn_value);
+// Function implementation - Process Image
+// BUTTONS is read once at the top of a pass and everything below decodes
+// from the snapshot, so repeated reads cost nothing and can't see different
+// values within a pass. JA and JB need sampling faster than a pass, so
+// encoder_service() reads each once per sample and hands the same filtered
+// word to the decoders and the echo stamps. Outputs are built up in g_Out
+// and each register is stored at most once, at the end of the pass, except
+// JC which goes out as soon as the bridge direction changes. The trig pins on
+// JB stay direct writes since their pulse width is timed.
+void process_image_latch() {
+  g_In.buttons = BUTTONS;
 }
 
-_Bool DownButton_pressed() {
-  static _Bool current_downbtn_value = 0, previous_downbtn_value = 0;
-  previous_downbtn_value = current_downbtn_value;
-  current_downbtn_value = BUTTONS & (1 << BTND_OFFSET);
-  return (current_downbtn_value && !previous_downbtn_value);
+void process_image_flush() {
+  static OutputImage written;
+  static _Bool first = true;
+  process_image_flush_jc();
+  if (first || g_Out.leds != written.leds) {LEDS = g_Out.leds;}
+  if (first || g_Out.seven_seg != written.seven_seg) {SEVEN_SEG = g_Out.seven_seg;}
+  if (first || g_Out.anodes != written.anodes) {ANODES = g_Out.anodes;}
+  written = g_Out;
+  first = false;
 }
 
-_Bool LeftButton_pressed() {
-  static _Bool current_leftbtn_value = 0, previous_leftbtn_value = 0;
-  previous_leftbtn_value = current_leftbtn_value;
-  current_leftbtn_value = BUTTONS & (1 << BTNL_OFFSET);
-  return (current_leftbtn_value && !previous_leftbtn_value);
+// JC carries the H-bridge direction pins, which can't wait for the end of the
+// pass: the PWM duty that goes with them is written to the timers straight
+// away. set_motion_type() flushes JC on the spot, the end of pass flush only
+// has anything to do if another JC bit changed
+void process_image_flush_jc() {
+  static uint32_t written;
+  static _Bool first = true;
+  if (first || g_Out.jc != written) {JC = g_Out.jc;}
+  written = g_Out.jc;
+  first = false;
 }
 
-_Bool RightButton_pressed() {
-  static _Bool current_rightbtn_value = 0, previous_rightbtn_value = 0;
-  previous_rightbtn_value = current_rightbtn_value;
-  current_rightbtn_value = BUTTONS & (1 << BTNR_OFFSET);
-  return (current_rightbtn_value && !previous_rightbtn_value);
+// Function implementation - Input Conditioning
+// Every pin of a port is filtered at once. The last GLITCH_M samples are
+// added up bit-sliced, bit i of c0/c1/c2 is the 3 bit count of ones seen on
+// pin i, so the cost depends on GLITCH_M but not on how many pins there are.
+// A pin goes high once GLITCH_N samples are high, low once GLITCH_N are low,
+// and otherwise keeps its last filtered level.
+static inline uint32_t pin_count_at_least(uint32_t c2, uint32_t c1, uint32_t c0, uint8_t n) {
+  uint32_t c[3] = {c0, c1, c2};
+  uint32_t gt = 0;
+  uint32_t eq = ~0u;
+
+  // Compare every pin's count against the constant n, MSB first
+  for (int b = 2; b >= 0; b--) {
+    if (n & (1 << b)) {eq &= c[b];}
+    else {
+      gt |= eq & c[b];
+      eq &= ~c[b];
+    }
+  }
+  return gt | eq;
 }
 
-// Function implementation - Quadrature Encoders
-uint32_t read_L1_quad_enc(_Bool reset)
-{
-    static uint32_t cnt = 0;
-    static _Bool quad_enc_last_state = 0;
+uint32_t pin_filter_update(PinFilter * filter, uint32_t raw) {
+  filter->history[filter->index] = raw;
+  filter->index = (filter->index + 1 < GLITCH_M) ? filter->index + 1 : 0;
 
-    if (reset)
-    {
-        cnt = 0;
-    }
+  uint32_t c0 = 0, c1 = 0, c2 = 0;
+  for (int i = 0; i < GLITCH_M; i++) {
+    uint32_t carry = c0 & filter->history[i];
+    c0 ^= filter->history[i];
+    c2 |= c1 & carry;
+    c1 ^= carry;
+  }
 
-    if ((quad_enc_last_state == 0) && (JA & (1 << L1_QUAD_ENC_OFFSET)))
-    {
-        cnt++;
+  uint32_t ones = pin_count_at_least(c2, c1, c0, GLITCH_N);
+  uint32_t zeros = ~pin_count_at_least(c2, c1, c0, GLITCH_M - GLITCH_N + 1);
+  filter->out = (filter->out & ~zeros) | ones;
+  return filter->out;
+}
+
+// Function implementation - Buttons
+// All four buttons are debounced together from the latched BUTTONS word.
+// Each bit has a 2 bit vertical counter (bit n of cnt0/cnt1) that counts
+// samples disagreeing with the debounced state, resets on any agreeing
+// sample and flips the state on the 4th in a row.
+void button_service() {
+  uint32_t now = timebase_now();
+  if ((int32_t)(now - g_Buttons.next_deadline) < 0) return;
+  g_Buttons.next_deadline = now + US_TO_TICKS(BTN_SAMPLE_US);
+
+  uint8_t delta = (g_In.buttons & BTN_MASK) ^ g_Buttons.state;
+  g_Buttons.cnt1 = (g_Buttons.cnt1 ^ g_Buttons.cnt0) & delta;
+  g_Buttons.cnt0 = ~g_Buttons.cnt0 & delta;
+  uint8_t toggle = delta & ~(g_Buttons.cnt0 | g_Buttons.cnt1);
+  g_Buttons.state ^= toggle;
+
+  uint8_t down = toggle & g_Buttons.state;
+  g_Buttons.events.pressed |= down;
+  g_Buttons.events.released |= toggle & ~g_Buttons.state;
+  g_Buttons.long_sent &= g_Buttons.state;
+
+  // Long press only needs a look at buttons that are held and haven't fired yet
+  uint8_t waiting = g_Buttons.state & ~g_Buttons.long_sent;
+  uint8_t bit = 1;
+  for (int i = 0; waiting; i++, bit <<= 1, waiting >>= 1, down >>= 1) {
+    if (down & 1) {g_Buttons.press_start[i] = now;}
+    else if ((waiting & 1) && (now - g_Buttons.press_start[i]) >= US_TO_TICKS(BTN_LONG_US)) {
+      g_Buttons.events.long_press |= bit;
+      g_Buttons.long_sent |= bit;
     }
-    quad_enc_last_state = JA & (1 << L1_QUAD_ENC_OFFSET);
-    return cnt;
+  }
+}
+
+// Returns the events since the last call and clears them
+ButtonEvents button_take_events() {
+  ButtonEvents events = g_Buttons.events;
+  g_Buttons.events.pressed = 0;
+  g_Buttons.events.released = 0;
+  g_Buttons.events.long_press = 0;
+  return events;
 }
 
-uint32_t read_R1_quad_enc(_Bool reset)
+// Function implementation - Quadrature Encoders
+// Both phases are sampled by encoder_service() and each legal transition
+// moves the count one step, giving 4 counts per slot with direction. A jump
+// across two states means samples were missed, it is counted and otherwise
+// ignored.
+static inline void quad_enc_update(QuadEncoder * enc, uint32_t pins, uint32_t now)
 {
-    static uint32_t cnt = 0;
-    static _Bool quad_enc_last_state = 0;
+    uint8_t ab = ((pins & enc->a_mask) ? 2 : 0) | ((pins & enc->b_mask) ? 1 : 0);
+    int8_t step = QUAD_STEP[(enc->last_ab << 2) | ab];
+    enc->last_ab = ab;
 
-    if (reset)
+    if (step == QUAD_ILLEGAL)
     {
-        cnt = 0;
+        enc->illegal++;
+        return;
     }
-    if ((quad_enc_last_state == 0) && (JA & (1 << R1_QUAD_ENC_OFFSET)))
+    if (step == 0) return;
+    if (enc->polarity < 0) {step = -step;}
+    enc->count += step;
+    enc->travel += (enc->dir < 0) ? -step : step;
+    enc->distance++;
+
+    // Stamp the edge, the stamp it replaces is QUAD_EDGES edges old. A
+    // reversal restarts the run since the span would straddle it
+    if (step != enc->edge_dir)
     {
-        cnt++;
+        enc->edge_dir = step;
+        enc->edge_run = 0;
     }
-    quad_enc_last_state = JA & (1 << R1_QUAD_ENC_OFFSET);
-    return cnt;
+    if (enc->edge_run <= QUAD_EDGES) {enc->edge_run++;}
+    enc->edge_span = now - enc->edge_time[enc->edge_index];
+    enc->edge_time[enc->edge_index] = now;
+    enc->edge_index = (enc->edge_index + 1) & (QUAD_EDGES - 1);
 }
 
-void set_motion_type(motion_type mode) {
-  switch (mode) {
-    case (right):
-    JC |= ((1 << LEFT1_OFFSET) | (1 << RIGHT2_OFFSET));
-    JC &= ~((1 << LEFT2_OFFSET) | (1 << RIGHT1_OFFSET));
-    break;
+// Function implementation - Odometry
+// The encoder totals are never reset. Each consumer marks the start of its
+// own segment and reads the delta from there, so motion tasks, braking and
+// calibration measure side by side without clearing each other's counts.
+// Deltas are taken modulo 2^32, so they stay exact across a wrap as long as
+// a segment is shorter than 2^31 counts.
+static inline int32_t odo_delta(uint32_t now, uint32_t then) {
+  return (int32_t)(now - then);
+}
 
-    case (left):
-    JC |= ((1 << LEFT2_OFFSET) | (1 << RIGHT1_OFFSET));
-    JC &= ~((1 << LEFT1_OFFSET) | (1 << RIGHT2_OFFSET));
-    break;
+void odo_mark(OdoMark * mark) {
+  mark->left = LeftEnc.travel;
+  mark->right = RightEnc.travel;
+}
 
-    case (straight):
-    JC |= ((1 << LEFT2_OFFSET) | (1 << RIGHT2_OFFSET));
-    JC &= ~((1 << LEFT1_OFFSET) | (1 << RIGHT1_OFFSET));
-    break;
+// Counts along the commanded direction since the mark, the unit motion tasks work in
+int32_t odo_left(const OdoMark * mark) {
+  return odo_delta(LeftEnc.travel, mark->left);
+}
 
-    case (stop):
-    JC |= ((1 << LEFT2_OFFSET) | (1 << LEFT1_OFFSET) | (1 << RIGHT2_OFFSET) | (1 << RIGHT1_OFFSET));
-    break;
+int32_t odo_right(const OdoMark * mark) {
+  return odo_delta(RightEnc.travel, mark->right);
+}
 
-    case (idle):
-    JC &= ~((1 << LEFT2_OFFSET) | (1 << LEFT1_OFFSET) | (1 << RIGHT2_OFFSET) | (1 << RIGHT1_OFFSET));
-    break;
+// Sampling runs off its own timebase deadline, independent of the maze FSM.
+// The echo port is sampled and glitch filtered here too, so the USS FSM sees
+// the same conditioning at the same rate.
+// With no interrupt controller it is polled from the top of every pass and
+// from control_service(). The blocking UART prints, the win stats and
+// ff_print_table(), only run once the motors are stopped, and a gap while a
+// wheel is turning is caught by encoder_check_gaps(). A late deadline takes
+// one sample and reschedules from now, there is nothing to gain from
+// catching up.
+void init_encoder_sampler() {
+  g_EncSampler.last_sample = timebase_now();
+  g_EncSampler.next_deadline = g_EncSampler.last_sample;
+  g_EncSampler.worst_interval = 0;
+  g_EncSampler.samples = 0;
+  g_EncSampler.missed_edges = 0;
+}
 
-    default:
-    JC &= ~((1 << LEFT2_OFFSET) | (1 << LEFT1_OFFSET) | (1 << RIGHT2_OFFSET) | (1 << RIGHT1_OFFSET));
+void encoder_service() {
+  uint32_t now = timebase_now();
+  if ((int32_t)(now - g_EncSampler.next_deadline) < 0) return;
+
+  uint32_t pins = pin_filter_update(&JaFilter, JA);
+  uint32_t jb = pin_filter_update(&JbFilter, JB);
+  quad_enc_update(&LeftEnc, pins, now);
+  quad_enc_update(&RightEnc, pins, now);
+  uss_echo_sample(&g_UssEngine, jb, now);
+
+  uint32_t interval = now - g_EncSampler.last_sample;
+  if (interval > g_EncSampler.worst_interval) {g_EncSampler.worst_interval = interval;}
+  g_EncSampler.last_sample = now;
+  g_EncSampler.next_deadline = now + ENC_SAMPLE_TICKS;
+  g_EncSampler.samples++;
+}
+
+// One encoder state lasts CONTROL_PERIOD_TICKS / (vel_q / 2^16) timebase
+// ticks. A gap at least that long can skip a state without the decoder
+// seeing it. Both sides are scaled down by 2^8 so the compare fits in 32 bits.
+static inline _Bool encoder_gap_too_long(uint32_t interval, int32_t vel_q) {
+  uint32_t speed = (vel_q < 0) ? -vel_q : vel_q;
+  if (interval > ENC_GAP_LIMIT) {interval = ENC_GAP_LIMIT;}
+  return ((interval >> 4) * (speed >> 4)) >= (CONTROL_PERIOD_TICKS << (PROFILE_Q_BITS - 8));
+}
+
+// Runs once per control tick, after the wheel speeds are updated
+void encoder_check_gaps() {
+  uint32_t gap = g_EncSampler.worst_interval;
+  if (encoder_gap_too_long(gap, LeftWheel.vel_q) || encoder_gap_too_long(gap, RightWheel.vel_q)) {
+    g_EncSampler.missed_edges++;
+  }
+  g_EncSampler.worst_interval = 0;
+}
+
+// One masked store into the JC shadow, flushed to the pins on the spot. Both
+// PWM outputs go off first, so an old duty never drives the bridge in its new
+// direction, and any duty the new motion wants is written after this returns
+// and never drives the old one. Out of range modes coast
+void set_motion_type(motion_type mode) {
+  static motion_type current = motion_type_count;
+  if (mode == current) {return;}
+  current = mode;
+
+  const BridgeSetting * bridge = &BRIDGE_TABLE[(mode < motion_type_count) ? mode : idle];
+  uint32_t jc = (g_Out.jc & ~BRIDGE_DIR_MASK) | bridge->jc;
+  if (jc != g_Out.jc) {
+    set_wheel_duty(&LeftPwm, 0);
+    set_wheel_duty(&RightPwm, 0);
+    g_Out.jc = jc;
+    process_image_flush_jc();
   }
+  if (bridge->left_dir) {LeftEnc.dir = bridge->left_dir;}
+  if (bridge->right_dir) {RightEnc.dir = bridge->right_dir;}
 }
 
-static inline uint8_t scale_correction(int32_t raw_correction) {
-  float raw_correction_mag = (raw_correction >= 0) ? raw_correction : -raw_correction;
-  if (raw_correction_mag >= 255.00f) return 0xFF;
-  else return (uint8_t) raw_correction_mag;
+// Function implementation - Hardware PWM
+// Each wheel uses both channels of one AXI timer: timer 0 sets the period and
+// timer 1 sets the high time. The pwm0 output of the pair drives the wheel's
+// PWM pin, so the CPU only touches the timer when the duty cycle changes.
+void init_motor_pwm() {
+  XTmrCtr_Initialize(&LeftPwm.timer, L_PWM_TIMER_BASEADDR);
+  XTmrCtr_Initialize(&RightPwm.timer, R_PWM_TIMER_BASEADDR);
+
+  // Configure the period once, output stays off until a duty is applied
+  XTmrCtr_PwmConfigure(&LeftPwm.timer, PWM_PERIOD_TICKS*TIMER_TICK_NS, TIMER_TICK_NS << PWM_TICK_SHIFT);
+  XTmrCtr_PwmConfigure(&RightPwm.timer, PWM_PERIOD_TICKS*TIMER_TICK_NS, TIMER_TICK_NS << PWM_TICK_SHIFT);
+  XTmrCtr_PwmDisable(&LeftPwm.timer);
+  XTmrCtr_PwmDisable(&RightPwm.timer);
+  LeftPwm.applied_duty = 0;
+  RightPwm.applied_duty = 0;
 }
 
-void PID_Controller_enc(_Bool reset, uint32_t L1, uint32_t R1) {
-  static int32_t error_sum = 0, error_prev = 0;
-  if (reset) {
-    error_sum = 0;
-    error_prev = 0;
+// Register math kept free of MMIO so it can be checked off-target:
+// PWM period is (TLR0 + 2) ticks and high time is (TLR1 + 2) ticks.
+// XTmrCtr_PwmConfigure() works TLR0 out from the ns values above, test/test_pwm.c
+// checks it against PWM_PERIOD_TICKS and the duty math below
+static inline uint32_t pwm_duty_to_high_tlr(uint8_t duty) {
+  // duty * PERIOD / (PWM_TOP+1) reduces to a constant shift, no divide needed
+  return ((uint32_t)duty << PWM_TICK_SHIFT) - 2;
+}
+
+void set_wheel_duty(PwmChannel * pwm, uint8_t duty) {
+  if (duty == pwm->applied_duty) return; // Nothing to do, hardware keeps running
+
+  if (duty == 0) {
+    XTmrCtr_PwmDisable(&pwm->timer); // 0 high time is not representable, turn output off
+  } 
+  else {
+    // New high time is picked up by the timer at the next period reload
+    XTmrCtr_SetLoadReg(pwm->timer.BaseAddress, XTC_TIMER_1, pwm_duty_to_high_tlr(duty));
+    if (pwm->applied_duty == 0) XTmrCtr_PwmEnable(&pwm->timer);
+  }
+  pwm->applied_duty = duty;
+}
+
+void update_motor_pwm() {
+  set_wheel_duty(&LeftPwm, g_LeftDutyCycle);
+  set_wheel_duty(&RightPwm, g_RightDutyCycle);
+}
+
+// Function implementation - Fixed-point PID
+// The core has no FPU, no multiplier and no barrel shifter, so the PID runs on
+// integers: gains are Q12 constants and products are built with shift-and-add.
+
+// Multiply a Q12 gain by an integer. Gains are small constants, so this loops
+// once per gain bit and doubles x with an add rather than a variable shift.
+static inline int32_t pid_q_mul(int32_t gain_q, int32_t x) {
+  int32_t product = 0;
+  while (gain_q) {
+    if (gain_q & 1) product += x;
+    x += x;
+    gain_q >>= 1;
   }
-  int32_t error = (int32_t)L1 - (int32_t)R1;
-  error_sum += error;
-	
-  int32_t error_diff = error - error_prev;
-	
-  float correction = KP_enc*error + KI_enc*error_sum + KD_enc*error_diff;
-  uint8_t correction_scaled = scale_correction(correction);
+  return product;
+}
+
+static inline int32_t pid_q_clamp(int32_t x) {
+  if (x > PID_INPUT_LIMIT) return PID_INPUT_LIMIT;
+  if (x < -PID_INPUT_LIMIT) return -PID_INPUT_LIMIT;
+  return x;
+}
+
+void pid_q_reset(PidQ * pid) {
+  pid->error_sum = 0;
+  pid->error_prev = 0;
+}
+
+// Advances the PID state and returns the raw correction in Q(PID_Q_BITS)
+static int32_t pid_q_sum(PidQ * pid, int32_t error) {
+  error = pid_q_clamp(error);
+  pid->error_sum = pid_q_clamp(pid->error_sum + error);
+  int32_t error_diff = pid_q_clamp(error - pid->error_prev);
+  pid->error_prev = error;
+
+  return pid_q_mul(pid->kp, error) + pid_q_mul(pid->ki, pid->error_sum) + pid_q_mul(pid->kd, error_diff);
+}
 
-  if (error > 0) {
-    if (g_RightDutyCycle + correction_scaled > 0xFF) {g_RightDutyCycle = 0xFF;}
-    else {g_RightDutyCycle += correction_scaled;}
+// Signed correction saturated to -PID_OUT_MAX..PID_OUT_MAX,
+// truncated toward zero like the float version it replaces
+int32_t pid_q_output(PidQ * pid, int32_t error) {
+  int32_t correction = pid_q_sum(pid, error);
+  if (correction >= (PID_OUT_MAX << PID_Q_BITS)) return PID_OUT_MAX;
+  if (correction <= -(PID_OUT_MAX << PID_Q_BITS)) return -PID_OUT_MAX;
+  return correction / (1 << PID_Q_BITS); // Rounds toward zero for either sign
+}
+
+// Heading loops: a positive result speeds up the right wheel and slows the left
+int32_t PID_Controller_enc(_Bool reset, int32_t L1, int32_t R1) {
+  if (reset) {pid_q_reset(&EncPid);}
+  int32_t error = L1 - R1;
+  return pid_q_output(&EncPid, error);
+}
+
+int32_t PID_Controller_drift(_Bool reset) {
+  if (reset) {pid_q_reset(&DriftPid);}
+  int32_t error = (int32_t) LEFT_DIST_SETPOINT - g_Uss[uss_left].dist;
+  return pid_q_output(&DriftPid, error);
+}
 
-    if (g_LeftDutyCycle - correction_scaled < 0xA0) {g_LeftDutyCycle = 0xA0;}
-    else {g_LeftDutyCycle -= correction_scaled;}
+// Function implementation - Trapezoidal Velocity Profile
+// One call to profile_step() per control tick produces the next velocity and
+// position setpoint: accelerate to cruise, hold, then decelerate so the
+// setpoint lands on the target. Distances are counts, time is control ticks.
+void profile_start(VelocityProfile * profile, uint32_t target_enc, 
+                   uint32_t cruise_q, uint32_t accel_q, uint32_t decel_q) {
+  profile->target_q = target_enc << PROFILE_Q_BITS;
+  profile->pos_q = 0;
+  profile->vel_q = 0;
+  profile->cruise_q = cruise_q;
+  profile->accel_q = accel_q;
+  profile->decel_q = decel_q;
+  profile->open = (target_enc == PROFILE_OPEN_TARGET);
+  profile->done = (target_enc == 0);
+}
+
+void profile_step(VelocityProfile * profile) {
+  if (profile->done) return;
+
+  // Stopping distance from the current speed is v^2 / 2d. Both sides are
+  // scaled down by 2^16 so the compare fits in 32 bits. These are the only
+  // multiplies in the profile and they run once per control tick.
+  uint32_t remaining_cnt = (profile->target_q - profile->pos_q) >> PROFILE_Q_BITS;
+  uint32_t vel_q8 = profile->vel_q >> (PROFILE_Q_BITS/2);
+  _Bool braking = !profile->open && (vel_q8*vel_q8 >= ((profile->decel_q*remaining_cnt) << 1));
+
+  if (braking) {
+    // Slow down to creep speed, a move too short to get up to it ramps up at the accel rate
+    if (profile->vel_q > profile->decel_q + PROFILE_MIN_VEL) {profile->vel_q -= profile->decel_q;}
+    else if (profile->vel_q + profile->accel_q < PROFILE_MIN_VEL) {profile->vel_q += profile->accel_q;}
+    else {profile->vel_q = PROFILE_MIN_VEL;}
   } 
-  else if (error < 0) { 
-    if (g_LeftDutyCycle + correction_scaled > 0xFF) {g_LeftDutyCycle = 0xFF;}
-    else {g_LeftDutyCycle += correction_scaled;}
+  else if (profile->vel_q < profile->cruise_q) {
+    profile->vel_q += profile->accel_q;
+    if (profile->vel_q > profile->cruise_q) {profile->vel_q = profile->cruise_q;}
+  }
+
+  // Open profiles hold cruise until replaced, their position is only used for short arcs
+  profile->pos_q += profile->vel_q;
+  if (profile->open) return;
+  if (profile->pos_q >= profile->target_q) {
+    profile->pos_q = profile->target_q;
+    profile->vel_q = 0;
+    profile->done = true;
+  }
+}
+
+// Function implementation - Feed-forward Calibration
+// Each wheel has a table of the duty needed to hold a velocity, so the
+// velocity PID only trims what the table gets wrong. The table starts as a
+// rough linear model and is replaced by a calibration sweep: the wheels run
+// at FF_CAL_POINTS duties and the encoder rate is counted at each.
+// The sweep prints one line per point and one per table for test/ff_tool.c:
+//   FFCAL <L|R> <duty> <velocity, Q16 counts per control tick>
+//   FFLUT <L|R> <duty at 0> <duty at 1 << FF_LUT_SHIFT> ... (FF_LUT_SIZE entries)
+static inline uint8_t ff_duty(const uint8_t lut[FF_LUT_SIZE], uint32_t vel_q) {
+  uint32_t i = vel_q >> FF_LUT_SHIFT;
+  if (i >= FF_LUT_SIZE - 1) return lut[FF_LUT_SIZE - 1];
+
+  // Linear interpolation between the two nearest entries
+  int32_t span = (int32_t)lut[i + 1] - lut[i];
+  int32_t frac = vel_q & ((1 << FF_LUT_SHIFT) - 1);
+  return lut[i] + ((span * frac) >> FF_LUT_SHIFT);
+}
+
+// Inverts the measured duty -> speed points into the evenly spaced speed -> duty table
+void ff_build_lut(uint8_t lut[FF_LUT_SIZE], const uint32_t vel_q[FF_CAL_POINTS]) {
+  uint32_t mono[FF_CAL_POINTS];
+  uint32_t fastest = 0;
 
-    if (g_RightDutyCycle - correction_scaled < 0xA0) {g_RightDutyCycle = 0xA0;}
-    else {g_RightDutyCycle -= correction_scaled;}
+  // Speed can only go up with duty, flatten any dips from measurement noise
+  for (int p = 0; p < FF_CAL_POINTS; p++) {
+    if (vel_q[p] > fastest) {fastest = vel_q[p];}
+    mono[p] = fastest;
+  }
+  if (fastest == 0) return; // Wheels never moved, keep the old table
+
+  uint8_t p = 0;
+  for (int k = 0; k < FF_LUT_SIZE; k++) {
+    uint32_t target = (uint32_t)k << FF_LUT_SHIFT;
+    while (p < FF_CAL_POINTS && mono[p] <= target) {p++;}
+
+    if (p == FF_CAL_POINTS) {lut[k] = PID_OUT_MAX;}
+    else if (p == 0) {lut[k] = FF_CAL_DUTY(0);}
+    else {
+      uint32_t step = ((target - mono[p-1]) << FF_CAL_DUTY_SHIFT) / (mono[p] - mono[p-1]);
+      lut[k] = FF_CAL_DUTY(p-1) + step;
+    }
   }
-	
-	error_prev = error;
 }
 
-void PID_Controller_drift(_Bool reset) {
-  static int32_t error_sum = 0, error_prev = 0;
-  if (reset) {
-    error_sum = 0;
-    error_prev = 0;
+void ff_print_table(char wheel, const uint8_t lut[FF_LUT_SIZE], const uint32_t vel_q[FF_CAL_POINTS]) {
+  for (int p = 0; p < FF_CAL_POINTS; p++) {
+    xil_printf("FFCAL %c %d %d\r\n", wheel, FF_CAL_DUTY(p), vel_q[p]);
   }
-  int32_t error = (int32_t) LEFT_DIST_SETPOINT - g_LeftDist;
-  error_sum += error;
-	
-  int32_t error_diff = error - error_prev;
-	
-  float correction = KP_enc*error + KI_enc*error_sum + KD_enc*error_diff;
-  uint8_t correction_scaled = scale_correction(correction);
+  xil_printf("FFLUT %c", wheel);
+  for (int k = 0; k < FF_LUT_SIZE; k++) {xil_printf(" %d", lut[k]);}
+  xil_printf("\r\n");
+}
 
-  if (error > 0) {
-    if (g_RightDutyCycle + correction_scaled > 0xFF) {g_RightDutyCycle = 0xFF;}
-    else {g_RightDutyCycle += correction_scaled;}
+void ff_calibration_start() {
+  g_Control.run_cascade = false;
+  g_Control.run_enc_pid = false;
+  g_Control.run_drift_pid = false;
+  g_Control.run_position_hold = false;
+  g_Control.run_brake = false;
+  g_Control.run_duty_update = true;
 
-    if (g_LeftDutyCycle - correction_scaled < 0xA0) {g_LeftDutyCycle = 0xA0;}
-    else {g_LeftDutyCycle -= correction_scaled;}
-  } 
-  else if (error < 0) { 
-    if (g_LeftDutyCycle + correction_scaled > 0xFF) {g_LeftDutyCycle = 0xFF;}
-    else {g_LeftDutyCycle += correction_scaled;}
+  set_motion_type(straight);
+  g_FfCal.point = 0;
+  g_FfCal.measuring = false;
+  g_FfCal.step_start = timebase_now();
+  g_LeftDutyCycle = FF_CAL_DUTY(0);
+  g_RightDutyCycle = FF_CAL_DUTY(0);
+}
+
+// Resumable, call every pass until it returns true
+_Bool ff_calibration_step() {
+  if (!g_FfCal.measuring) {
+    if (timebase_elapsed(g_FfCal.step_start) < US_TO_TICKS(FF_CAL_SETTLE_US)) return false;
+    g_FfCal.start_left = LeftEnc.count;
+    g_FfCal.start_right = RightEnc.count;
+    g_FfCal.step_start = timebase_now();
+    g_FfCal.measuring = true;
+    return false;
+  }
+  if (timebase_elapsed(g_FfCal.step_start) < (CONTROL_PERIOD_TICKS << FF_CAL_WINDOW_SHIFT)) return false;
+
+  // The window is a power of two control periods, so counts scale to velocity with a shift
+  uint8_t p = g_FfCal.point;
+  int32_t left_cnt = odo_delta(LeftEnc.count, g_FfCal.start_left);
+  int32_t right_cnt = odo_delta(RightEnc.count, g_FfCal.start_right);
+  g_FfCal.left_vel_q[p] = (left_cnt > 0) ? (uint32_t)left_cnt << (PROFILE_Q_BITS - FF_CAL_WINDOW_SHIFT) : 0;
+  g_FfCal.right_vel_q[p] = (right_cnt > 0) ? (uint32_t)right_cnt << (PROFILE_Q_BITS - FF_CAL_WINDOW_SHIFT) : 0;
+  g_FfCal.point++;
+  g_FfCal.measuring = false;
+  g_FfCal.step_start = timebase_now();
+
+  if (g_FfCal.point < FF_CAL_POINTS) {
+    g_LeftDutyCycle = FF_CAL_DUTY(g_FfCal.point);
+    g_RightDutyCycle = FF_CAL_DUTY(g_FfCal.point);
+    return false;
+  }
+
+  g_Control.run_duty_update = false;
+  g_LeftDutyCycle = 0;
+  g_RightDutyCycle = 0;
+  update_motor_pwm();
+  set_motion_type(stop);
+  ff_build_lut(LeftWheel.ff_lut, g_FfCal.left_vel_q);
+  ff_build_lut(RightWheel.ff_lut, g_FfCal.right_vel_q);
+  ff_print_table('L', LeftWheel.ff_lut, g_FfCal.left_vel_q);
+  ff_print_table('R', RightWheel.ff_lut, g_FfCal.right_vel_q);
+  return true;
+}
+
+// Function implementation - Velocity/Position Cascade
+// Inner loop: each wheel's duty regulates its measured speed to a velocity
+// reference. Outer loops (position hold, encoder heading, wall drift) only
+// move the two velocity references, so ground speed no longer depends on
+// battery voltage or floor friction.
+void wheel_velocity_reset(WheelVelocity * wheel) {
+  for (int i = 0; i < VEL_WINDOW; i++) {wheel->history[i] = wheel->enc->count;}
+  wheel->index = 0;
+  wheel->vel_q = 0;
+  pid_q_reset(&wheel->pid);
+}
 
-    if (g_RightDutyCycle - correction_scaled < 0xA0) {g_RightDutyCycle = 0xA0;}
-    else {g_RightDutyCycle -= correction_scaled;}
+// Speed from the time the last QUAD_EDGES edges took, in Q16 counts per tick.
+// Between edges it decays as if the next edge were due now, so a stalling
+// wheel reads towards zero instead of holding its last speed.
+// There is no divider: the span is shifted down to its top VEL_RECIP_BITS
+// bits, the reciprocal of those comes from VEL_EDGE_RECIP and is shifted back
+// by the same amount. Both shifts are single bit steps, there is no barrel
+// shifter either. The error is under 1/(2*VEL_RECIP_SIZE) plus a count of the
+// shifted result, under 1% and well inside the resolution of the edge stamps.
+static inline int32_t wheel_edge_velocity(const QuadEncoder * enc, uint32_t now) {
+  uint32_t since = now - enc->edge_time[(enc->edge_index - 1) & (QUAD_EDGES - 1)];
+  if (since >= VEL_STALL_TICKS) return 0;
+  uint32_t span = enc->edge_span;
+  if (since * QUAD_EDGES > span) {span = since * QUAD_EDGES;}
+  if (span < VEL_RECIP_SIZE) {span = VEL_RECIP_SIZE;} // Far beyond any real wheel speed
+
+  int shift = 0;
+  while (span >= 2*VEL_RECIP_SIZE) {
+    span >>= 1;
+    shift++;
   }
-	error_prev = error;
+  int32_t vel = VEL_EDGE_RECIP[span - VEL_RECIP_SIZE];
+  while (shift--) {vel >>= 1;}
+  return (enc->edge_dir < 0) ? -vel : vel;
+}
+
+// Counts moved over the last VEL_WINDOW ticks, scaled to Q16 counts per tick.
+// At low speed that is only a handful of counts and steps coarsely, so below
+// VEL_EDGE_MAX_COUNTS the speed is timed from the edges instead. Uses the raw
+// count, which is never reset, so speed carries across motions
+void wheel_velocity_sample(WheelVelocity * wheel) {
+  uint32_t count = wheel->enc->count;
+  int32_t moved = odo_delta(count, wheel->history[wheel->index]);
+  _Bool slow = (moved < VEL_EDGE_MAX_COUNTS) && (moved > -VEL_EDGE_MAX_COUNTS);
+  if (slow && wheel->enc->edge_run > QUAD_EDGES) {
+    wheel->vel_q = wheel_edge_velocity(wheel->enc, timebase_now());
+  }
+  else {
+    wheel->vel_q = moved * (1 << (PROFILE_Q_BITS - VEL_WINDOW_SHIFT));
+  }
+  wheel->history[wheel->index] = count;
+  wheel->index = (wheel->index + 1) & (VEL_WINDOW - 1);
+}
+
+uint8_t wheel_velocity_loop(WheelVelocity * wheel, int32_t vel_ref) {
+  if (vel_ref <= 0) {
+    pid_q_reset(&wheel->pid);
+    return 0;
+  }
+  // Measured speed along the direction the H-bridge is driving this wheel
+  int32_t vel_meas = (wheel->enc->dir < 0) ? -wheel->vel_q : wheel->vel_q;
+  int32_t error = (vel_ref - vel_meas) / (1 << VEL_ERR_SHIFT);
+  int32_t duty = ff_duty(wheel->ff_lut, vel_ref) + pid_q_output(&wheel->pid, error);
+  return (duty < 0) ? 0 : ((duty > PID_OUT_MAX) ? PID_OUT_MAX : duty);
+}
+
+// Only curved turns scale a wheel, so straights and pivots skip the multiply
+static inline uint32_t motion_scale(uint32_t x_q, uint32_t ratio_q) {
+  if (ratio_q == MOTION_RATIO_ONE) return x_q;
+  return (x_q >> (PROFILE_Q_BITS/2)) * (ratio_q >> (PROFILE_Q_BITS/2));
+}
+
+void run_cascade(int32_t L1, int32_t R1) {
+  profile_step(&g_Profile);
+  int32_t left_ref = motion_scale(g_Profile.vel_q, g_Motion.left_ratio_q);
+  int32_t right_ref = motion_scale(g_Profile.vel_q, g_Motion.right_ratio_q);
+
+  // Outer loops turn position and heading errors into velocity corrections
+  if (g_Control.run_position_hold) {
+    int32_t left_set = motion_scale(g_Profile.pos_q, g_Motion.left_ratio_q) >> PROFILE_Q_BITS;
+    int32_t right_set = motion_scale(g_Profile.pos_q, g_Motion.right_ratio_q) >> PROFILE_Q_BITS;
+    left_ref += (left_set - L1) * POS_TO_VEL_GAIN;
+    right_ref += (right_set - R1) * POS_TO_VEL_GAIN;
+  }
+  int32_t heading = 0;
+  if (g_Control.run_enc_pid) {heading += PID_Controller_enc(0, L1, R1);}
+  if (g_Control.run_drift_pid) {heading += PID_Controller_drift(0);}
+  left_ref -= heading * (1 << HEADING_TO_VEL_SHIFT);
+  right_ref += heading * (1 << HEADING_TO_VEL_SHIFT);
+
+  g_LeftDutyCycle = wheel_velocity_loop(&LeftWheel, left_ref);
+  g_RightDutyCycle = wheel_velocity_loop(&RightWheel, right_ref);
+}
+
+// Function implementation - Active Braking
+// Each wheel is driven in reverse, harder the faster it rolls forward, until
+// its forward speed is at or below BRAKE_STOP_VEL, rolling back included.
+// Then the H-bridge is shorted to hold it. Full reverse past
+// BRAKE_TARGET_CNT also needs the wheel still rolling forward.
+uint8_t brake_wheel_duty(WheelVelocity * wheel, int32_t travelled) {
+  if (wheel->vel_q <= (int32_t)BRAKE_STOP_VEL) return 0;
+  if (travelled >= BRAKE_TARGET_CNT) return PID_OUT_MAX;
+
+  uint32_t duty = BRAKE_DUTY_MIN + (wheel->vel_q >> BRAKE_VEL_SHIFT);
+  return (duty > PID_OUT_MAX) ? PID_OUT_MAX : duty;
+}
+
+void run_brake() {
+  g_LeftDutyCycle = brake_wheel_duty(&LeftWheel, odo_delta(LeftEnc.count, g_Brake.start_left));
+  g_RightDutyCycle = brake_wheel_duty(&RightWheel, odo_delta(RightEnc.count, g_Brake.start_right));
+
+  _Bool stopped = (g_LeftDutyCycle == 0) && (g_RightDutyCycle == 0);
+  if (stopped || (g_Control.tick_count - g_Brake.start_tick) >= BRAKE_TIMEOUT_TICKS) {
+    set_motion_type(stop);
+    g_LeftDutyCycle = PID_OUT_MAX; // Enabled with both legs high shorts the motor
+    g_RightDutyCycle = PID_OUT_MAX;
+    g_Control.run_brake = false;
+  }
+}
+
+_Bool brake_is_done() {
+  return !g_Control.run_brake;
 }
 
 // Functions for navigation
-void drive_straight_distance(uint32_t inches) {
-  PID_Controller_enc(true, 0, 0);
-  read_L1_quad_enc(1);
-  read_R1_quad_enc(1);  
+// Straight moves and pivots are motion tasks: start once, then call
+// motion_step() every pass until motion_is_done(). Nothing here blocks.
+void motion_start_distance(uint32_t inches) {
+  odo_mark(&g_Segment);
+  wheel_velocity_reset(&LeftWheel);
+  wheel_velocity_reset(&RightWheel);
+  g_Control.run_cascade = true;
+  g_Control.run_enc_pid = false;
+  g_Control.run_drift_pid = false;
+  g_Control.run_position_hold = true;
+  g_Control.run_duty_update = false; // Wheels are stopped individually in motion_step()
   
-  g_LeftDutyCycle = 0xCF;
-  g_RightDutyCycle = 0xCF;
+  g_LeftDutyCycle = 0;
+  g_RightDutyCycle = 0;
 
   // Inches to encoder count
-  uint32_t distance_enc = inches*CNT_PER_INCH;
-  uint8_t pwmCnt = 0;
+  g_Motion.target_left = inches*CNT_PER_INCH;
+  g_Motion.target_right = g_Motion.target_left;
+  g_Motion.left_ratio_q = MOTION_RATIO_ONE;
+  g_Motion.right_ratio_q = MOTION_RATIO_ONE;
+  g_Motion.active = true;
+  profile_start(&g_Profile, g_Motion.target_left, CPS_TO_VEL_Q(STRAIGHT_CRUISE_CPS), 
+                CPS2_TO_ACC_Q(STRAIGHT_ACCEL_CPS2), CPS2_TO_ACC_Q(STRAIGHT_DECEL_CPS2));
+}
+
+// Both wheels follow the same profile and the encoder heading loop holds
+// their counts together, so the pivot stays on the spot at any angle
+void motion_start_turn(uint32_t degrees) {   
+  odo_mark(&g_Segment);
+  wheel_velocity_reset(&LeftWheel);
+  wheel_velocity_reset(&RightWheel);
+  PID_Controller_enc(true, 0, 0);
+  g_Control.run_cascade = true;
+  g_Control.run_enc_pid = true;
+  g_Control.run_drift_pid = false;
+  g_Control.run_position_hold = true;
+  g_Control.run_duty_update = false;
+
+  g_RightDutyCycle = 0;
+  g_LeftDutyCycle = 0;
   
-  while (read_L1_quad_enc(0) < distance_enc || read_R1_quad_enc(0) < distance_enc) {
-    if (read_L1_quad_enc(0) < distance_enc && pwmCnt <= g_LeftDutyCycle) JC |= (1 << L_PWM_OFFSET);
-    else JC &= ~(1 << L_PWM_OFFSET);
+  // Each wheel runs on a circle of half the wheel base
+  g_Motion.target_left = arc_counts(WHEEL_HALF_BASE_Q8, degrees);
+  g_Motion.target_right = g_Motion.target_left;
+  g_Motion.left_ratio_q = MOTION_RATIO_ONE;
+  g_Motion.right_ratio_q = MOTION_RATIO_ONE;
+  g_Motion.active = true;
+  profile_start(&g_Profile, g_Motion.target_left, CPS_TO_VEL_Q(TURN_CRUISE_CPS), 
+                CPS2_TO_ACC_Q(TURN_ACCEL_CPS2), CPS2_TO_ACC_Q(TURN_DECEL_CPS2));
+}
 
-    if (read_R1_quad_enc(0) < distance_enc && pwmCnt <= g_RightDutyCycle) JC |= (1 << R_PWM_OFFSET);
-    else JC &= ~(1 << R_PWM_OFFSET);
+// Counts a wheel travels on a circle of radius_q8 (inches in Q8), rounded to the nearest count
+static inline uint32_t arc_counts(uint32_t radius_q8, uint32_t degrees) {
+  uint32_t cnt_per_deg_q = (ARC_CNT_PER_DEG_INCH_Q * radius_q8) >> 8;
+  return (degrees*cnt_per_deg_q + (1 << (ARC_Q_BITS - 1))) >> ARC_Q_BITS;
+}
 
-    if (++pwmCnt == PWM_TOP) pwmCnt = 0;
+// Curved turn: the outer wheel follows the profile and the inner wheel follows
+// it scaled by the ratio of the two radii, so the robot sweeps an arc of
+// radius_inch around a point beside it. The robot enters at the speed it is
+// already driving and the profile is left open, so it leaves the arc still
+// moving. Only the outer wheel's arc is ever long enough to need the profile.
+void motion_start_arc(uint32_t radius_inch, uint32_t degrees, motion_type dir) {
+  uint32_t entry_vel_q = g_Profile.done ? 0 : g_Profile.vel_q;
+  odo_mark(&g_Segment);
+  g_Control.run_cascade = true;
+  g_Control.run_enc_pid = false;
+  g_Control.run_drift_pid = false;
+  g_Control.run_position_hold = true;
+  g_Control.run_duty_update = false;
+
+  // Radius is to the centre of the robot, the wheels sit half a base either side
+  uint32_t radius_q8 = radius_inch << 8;
+  uint32_t inner_q8 = (radius_q8 > WHEEL_HALF_BASE_Q8) ? radius_q8 - WHEEL_HALF_BASE_Q8 : 0;
+  uint32_t outer_cnt = arc_counts(radius_q8 + WHEEL_HALF_BASE_Q8, degrees);
+  uint32_t inner_cnt = arc_counts(inner_q8, degrees);
+  uint32_t inner_ratio_q = (inner_cnt << PROFILE_Q_BITS) / outer_cnt;
+
+  // The wheel a pivot in the same direction drives forward is the outer wheel,
+  // taken from BRIDGE_TABLE so arcs and pivots can't turn opposite ways
+  if (BRIDGE_TABLE[dir].left_dir > 0) {
+    g_Motion.target_left = outer_cnt;
+    g_Motion.target_right = inner_cnt;
+    g_Motion.left_ratio_q = MOTION_RATIO_ONE;
+    g_Motion.right_ratio_q = inner_ratio_q;
+  }
+  else {
+    g_Motion.target_left = inner_cnt;
+    g_Motion.target_right = outer_cnt;
+    g_Motion.left_ratio_q = inner_ratio_q;
+    g_Motion.right_ratio_q = MOTION_RATIO_ONE;
+  }
+  g_Motion.active = true;
+  profile_start(&g_Profile, PROFILE_OPEN_TARGET, CPS_TO_VEL_Q(ARC_CRUISE_CPS), 
+                CPS2_TO_ACC_Q(STRAIGHT_ACCEL_CPS2), CPS2_TO_ACC_Q(STRAIGHT_DECEL_CPS2));
+  g_Profile.vel_q = entry_vel_q;
+}
 
-    PID_Controller_enc(false, read_L1_quad_enc(0), read_R1_quad_enc(0));
-    LEDS = (g_LeftDutyCycle << 8) | g_RightDutyCycle;
-  } 
+void motion_step() {
+  if (!g_Motion.active) return;
+
+  int32_t L1 = odo_left(&g_Segment);
+  int32_t R1 = odo_right(&g_Segment);
+  // Counts go negative if a wheel is pushed backwards, compare signed
+  _Bool left_done = L1 >= (int32_t)g_Motion.target_left;
+  _Bool right_done = R1 >= (int32_t)g_Motion.target_right;
+  if (left_done && right_done) {
+    set_wheel_duty(&LeftPwm, 0);
+    set_wheel_duty(&RightPwm, 0);
+    g_Control.run_cascade = false;
+    g_Motion.active = false;
+    return;
+  }
+
+  // Each wheel stops as soon as it reaches the target
+  set_wheel_duty(&LeftPwm, left_done ? 0 : g_LeftDutyCycle);
+  set_wheel_duty(&RightPwm, right_done ? 0 : g_RightDutyCycle);
+  g_Out.leds = (g_LeftDutyCycle << 8) | g_RightDutyCycle;
+}
+
+_Bool motion_is_done() {
+  return !g_Motion.active;
 }
 
 void drive_straight(drive_state cmd) {
-  static uint8_t pwmCnt = 0;
-  uint32_t L1, R1;
+  uint32_t entry_vel_q;
   switch (cmd) {
     case init_drive:
-      // Reset variables and states for driving
-      L1 = read_L1_quad_enc(1);
-      R1 = read_R1_quad_enc(1);
-      PID_Controller_enc(true, L1, R1); // 1 is rst, reset to not start with imaginary error
+      // Reset variables and states for driving. Coming out of a curved turn
+      // the robot is still moving, so the speed carries over instead of restarting
+      entry_vel_q = g_Profile.done ? 0 : g_Profile.vel_q;
+      odo_mark(&g_Segment);
+      PID_Controller_enc(true, 0, 0); // 1 is rst, reset to not start with imaginary error
       PID_Controller_drift(true);
-      pwmCnt = 0;
-      g_LeftDutyCycle = 0xCF;
-      g_RightDutyCycle = 0xCF;
+      if (entry_vel_q == 0) {
+        pid_q_reset(&LeftWheel.pid);
+        pid_q_reset(&RightWheel.pid);
+      }
+
+      // Ramp up to cruise speed and hold it until stop_driving
+      g_Motion.left_ratio_q = MOTION_RATIO_ONE;
+      g_Motion.right_ratio_q = MOTION_RATIO_ONE;
+      profile_start(&g_Profile, PROFILE_OPEN_TARGET, CPS_TO_VEL_Q(STRAIGHT_CRUISE_CPS), 
+                    CPS2_TO_ACC_Q(STRAIGHT_ACCEL_CPS2), CPS2_TO_ACC_Q(STRAIGHT_DECEL_CPS2));
+      g_Profile.vel_q = entry_vel_q;
+      g_Control.run_cascade = true;
+      g_Control.run_enc_pid = true;
+      g_Control.run_position_hold = false;
+      g_Control.run_duty_update = true;
       break;
 
     case driving:
-      if (pwmCnt <= g_LeftDutyCycle) {JC |= (1 << L_PWM_OFFSET);}
-      else {JC &= ~(1 << L_PWM_OFFSET);}
-    
-      if (pwmCnt <= g_RightDutyCycle) {JC |= (1 << R_PWM_OFFSET);}
-      else {JC &= ~(1 << R_PWM_OFFSET);}
-    
-      if (++pwmCnt == PWM_TOP) {pwmCnt = 0;}
-      PID_Controller_enc(0, read_L1_quad_enc(0), read_R1_quad_enc(0));
+      // Cascade and duty updates run from control_service() at CONTROL_RATE_HZ
       break;
 
     case stop_driving:
+      g_Profile.done = true;
+      g_Control.run_cascade = false;
+      g_Control.run_enc_pid = false;
+      g_Control.run_drift_pid = false;
+      g_Control.run_duty_update = false;
       g_LeftDutyCycle = 0;
       g_RightDutyCycle = 0;
-      JC &= ~(1 << L_PWM_OFFSET);
-      JC &= ~(1 << R_PWM_OFFSET);
+      update_motor_pwm();
+      break;
+
+    case brake_driving:
+      // Reverse drive from control_service() until both wheels stop
+      g_Profile.done = true;
+      g_Control.run_cascade = false;
+      g_Control.run_enc_pid = false;
+      g_Control.run_drift_pid = false;
+      g_Brake.start_left = LeftEnc.count;
+      g_Brake.start_right = RightEnc.count;
+      g_Brake.start_tick = g_Control.tick_count;
+      set_motion_type(reverse);
+      g_Control.run_brake = true;
+      g_Control.run_duty_update = true;
+      run_brake(); // The first reverse duty goes out with the direction, not a control tick later
+      update_motor_pwm();
+      break;
   }
   
 }
 
-void turn(uint32_t degrees) {   
-    // PID_Controller(true, 0, 0);
-    read_L1_quad_enc(1);
-    read_R1_quad_enc(1);
-
-    g_RightDutyCycle = 0xDF;
-    g_LeftDutyCycle = 0xDF;
-    
-    // Degrees to Arc Length
-    // Correction for 180deg turns
-    if (degrees == 180) degrees += 12;
-    float turn_fraction = (float) degrees/360;
-    float arc_length_inches = turn_fraction*PI*6.625;
-    uint32_t arc_length_enc = arc_length_inches*CNT_PER_INCH;
-    uint8_t pwmCnt = 0;
-
-    while (read_L1_quad_enc(0) < arc_length_enc || read_R1_quad_enc(0) < arc_length_enc) {
-        if (read_L1_quad_enc(0) < arc_length_enc && pwmCnt <= g_LeftDutyCycle) JC |= (1 << L_PWM_OFFSET);
-        else JC &= ~(1 << L_PWM_OFFSET);
-
-        if (read_R1_quad_enc(0) < arc_length_enc && pwmCnt <= g_RightDutyCycle) JC |= (1 << R_PWM_OFFSET);
-        else JC &= ~(1 << R_PWM_OFFSET);
-
-        if (++pwmCnt == PWM_TOP) pwmCnt = 0;
-
-        // PID_Controller(false, read_L1_quad_enc(0), read_R1_quad_enc(0));
-        LEDS = (g_LeftDutyCycle << 8) | g_RightDutyCycle;
+// Functions for the Ultrasonic Sensors
+// One engine scans every sensor in the array: the sensors ping one phase
+// apart, then each echo is timed from its edge stamps, median filtered and
+// converted to cm. Pins are handled as port-wide masks, so the echo poll
+// is a few mask operations no matter how many sensors there are and only
+// sensors with an echo in flight are visited.
+void uss_engine_init(UssEngine * uss, UltrasonicSensor * sensors, uint8_t count) {
+  uss->sensors = sensors;
+  uss->count = count;
+  uss->trig_mask = 0;
+  uss->echo_mask = 0;
+  uss->capture_mask = 0;
+  uss->armed = 0;
+  uss->trig_high = 0;
+  uss->crosstalk = 0;
+  for (int i = 0; i < count; i++) {
+    uss->trig_mask |= sensors[i].trig_mask;
+    uss->echo_mask |= sensors[i].echo_mask;
+    if (sensors[i].capture) {
+      // Both timers count up freely and are started together, so the two
+      // captures share one clock. Without the hold bit a capture stays put
+      // until its event flag is cleared, see uss_capture_arm()
+      XTmrCtr_Initialize(sensors[i].capture, ECHO_CAPTURE_BASEADDR);
+      XTmrCtr_SetOptions(sensors[i].capture, XTC_TIMER_0, XTC_CAPTURE_MODE_OPTION);
+      XTmrCtr_SetOptions(sensors[i].capture, XTC_TIMER_1, XTC_CAPTURE_MODE_OPTION | XTC_ENABLE_ALL_OPTION);
+      uss->capture_mask |= sensors[i].echo_mask;
     }
+    for (int k = 0; k < MED_FILT_WINDOW; k++) {sensors[i].buf[k] = US_TO_TICKS(14);}
+    for (int k = 0; k < MED_FILT_WINDOW; k++) {sensors[i].sorted[k] = US_TO_TICKS(14);}
+  }
+  uss->buf_index = 0;
+  uss->state = send_trig;
 }
 
-void read_2_uss_fsm(UltrasonicSensor * uss1, 
-                    UltrasonicSensor * uss2, 
-                    // float * dist_1, 
-                    // float * dist_2,
-                    uint32_t buf1[MED_FILT_WINDOW],
-                    uint32_t buf2[MED_FILT_WINDOW]) {
-  static uss_state state = send_trig;
-  uss_state next_state = state;
-  static _Bool last_echo_1 = false, last_echo_2 = false;
-  static _Bool curr_echo_1 = false, curr_echo_2 = false;
-  static _Bool seen_echo_1 = false, seen_echo_2 = false;
-  static _Bool echo1_read = false, echo2_read = false;
-  uint32_t curr_ticks_1 = 0, curr_ticks_2 = 0;
-  uint32_t temp_buf1[MED_FILT_WINDOW], temp_buf2[MED_FILT_WINDOW];
-
-  switch (state)
+void uss_engine_step(UssEngine * uss) {
+  uss_state next_state = uss->state;
+  uint32_t active;
+  uint32_t now;
+
+  switch (uss->state)
   {
   case send_trig:
-    // Ensure trig is cleared
-    clear_trig_pin(*uss1);
-    clear_trig_pin(*uss2);
-    // Start the 10us pulse by setting both trig pins to high then moving state
-    set_trig_pin(*uss1);
-    set_trig_pin(*uss2);
-    start_stopwatch(5);
-    next_state = clear_trig;
-    break;
-
-  case clear_trig:
-    // Wait until 10us have passed before clearing trig
-    if (read_stopwatch(5) >= 10) {
-      clear_trig_pin(*uss1);
-      clear_trig_pin(*uss2);
-      next_state = count_echo_duration;
-
-      // Ensure flags are cleared
-      echo1_read = false;
-      echo2_read = false;
-      last_echo_1 = false;
-      last_echo_2 = false;
-      seen_echo_1 = false;
-      seen_echo_2 = false;
-    }
+    // Ensure flags are cleared, then start the scan. Sensors are armed as
+    // uss_trigger_service() fires them
+    uss->seen = 0;
+    uss->fallen = 0;
+    uss->done = 0;
+    uss->rejected = 0;
+    uss->fired = 0;
+    uss->armed = 0;
+    uss->last_echo = 0;
+    uss->trig_time = timebase_now();
+    uss->next_fire_time = uss->trig_time;
+    uss->next_fire = 0;
+    uss_trigger_service(uss);
+    next_state = count_echo_duration;
     break;
 
   case count_echo_duration:
-    // Start each ultrasonic's hw timer when their echo pin goes high,
-    // read it on the falling edge.
-    curr_echo_1 = read_echo_pin(*uss1);
-    curr_echo_2 = read_echo_pin(*uss2);
-    if (!echo1_read) {
-      if (seen_echo_1) curr_ticks_1 = read_stopwatch(uss1->hw_timer_channel);
-      else curr_ticks_1 = 0;
-    }
-    if (!echo2_read) {
-      if (seen_echo_2) curr_ticks_2 = read_stopwatch(uss2->hw_timer_channel);
-      else curr_ticks_2 = 0;
-    }
-
-    if (curr_echo_1 && !last_echo_1) {  // 1 echo rising edge
-      start_stopwatch(uss1->hw_timer_channel);
-      seen_echo_1 = true;
-    } 
-    if (curr_echo_2 && !last_echo_2) {  // 2 echo rising edge
-      start_stopwatch(uss2->hw_timer_channel);
-      seen_echo_2 = true;
-    } 
-    if (!curr_echo_1 && last_echo_1) {  // 1 falling edge
-      uss1->raw_echo_high_time = curr_ticks_1;
-      echo1_read = true;
-    }
-    if (!curr_echo_2 && last_echo_2) { // 2 falling edge
-      uss2->raw_echo_high_time = curr_ticks_2;
-      echo2_read = true;
-    }
-
-    // Timeout if distance is more than DIST_THRESHOLD
-    // We don't care what the actual value is as long as we know
-    // whether its +/- our threshold, so grab the current value to put into buffer
-    if ((curr_ticks_1 >= TIMEOUT_TICKS) && seen_echo_1) {
-      echo1_read = true;
-      uss1->raw_echo_high_time = curr_ticks_1;
-    }
-    if ((curr_ticks_2 >= TIMEOUT_TICKS) && seen_echo_2) {
-      echo2_read = true;
-      uss2->raw_echo_high_time = curr_ticks_2;
+    // Echo edges are latched by the capture timers or stamped by
+    // encoder_service(), so this only fires the remaining sensors and
+    // collects finished measurements, its own timing doesn't matter
+    uss_trigger_service(uss);
+    uss_capture_poll(uss);
+    active = uss->seen & ~uss->done;
+    now = timebase_now();
+
+    for (int i = 0; active && i < uss->count; i++) {
+      UltrasonicSensor * s = &uss->sensors[i];
+      if (!(active & s->echo_mask)) continue;
+      active &= ~s->echo_mask;
+      // Timeout if distance is more than DIST_THRESHOLD
+      // We don't care what the actual value is as long as we know
+      // whether its +/- our threshold, so grab the current value to put into buffer
+      _Bool fell = uss->fallen & s->echo_mask;
+      uint32_t ticks = (fell ? s->fall_time : now) - s->rise_time;
+      _Bool in_range = fell && ticks < TIMEOUT_TICKS;
+      if (!fell && ticks < TIMEOUT_TICKS) continue;
+      if (in_range && uss_xtalk_pending(uss, s, now)) continue;
+
+      s->raw_echo_high_time = ticks;
+      uss->done |= s->echo_mask; // Its falling edge is still stamped, for the cooldown
+      if (in_range && uss_is_crosstalk(uss, s)) {
+        uss->rejected |= s->echo_mask;
+        uss->crosstalk++;
+      }
     }
 
-    if (echo1_read && echo2_read) {next_state = median_filter;}
-
-    last_echo_1 = curr_echo_1;
-    last_echo_2 = curr_echo_2;
+    if (uss->done == uss->echo_mask && !uss->trig_high) {next_state = median_filter;}
     break;
 
   case median_filter:
     // Median filter:
-      // Take the last five readings from the uss and sort them using selection sort (from cs211)
-      // This will sort outliers (erroneously high or low readings) to the extrema
+      // Take the median of the last five readings from each uss
+      // Outliers (erroneously high or low readings) end up at the extrema,
       // taking the median ensures that we have a more consistent value
       //
       // For example, the burst hitting a wire and returning very quicjly could cause us to turn:
       // With this filter, we need at least 3 measurements below the turn threshold before we believe them
-      // Add new readings to buffers
-    buf1[buf_write_index] = uss1->raw_echo_high_time;
-    buf2[buf_write_index] = uss2->raw_echo_high_time;
-    if (++buf_write_index == MED_FILT_WINDOW) {buf_write_index = 0;} // Reset back to index 0 if at max
-
-    // Create local copies of buffers
-    for (int i = 0; i < MED_FILT_WINDOW; i++) {
-        temp_buf1[i] = buf1[i];
-        temp_buf2[i] = buf2[i];
+      // Crosstalk never enters the window, the sensor keeps its last median
+    for (int i = 0; i < uss->count; i++) {
+      UltrasonicSensor * s = &uss->sensors[i];
+      if (uss->rejected & s->echo_mask) continue;
+      s->med_echo_high_time = median_filter_push(s, uss->buf_index, s->raw_echo_high_time);
     }
-
-    selection_sort(temp_buf1, MED_FILT_WINDOW);
-    selection_sort(temp_buf2, MED_FILT_WINDOW);
-
-    uss1->med_echo_high_time = temp_buf1[MED_FILT_WINDOW/2]; // Integer division (e.g. 5/2 = 2)
-    uss2->med_echo_high_time = temp_buf2[MED_FILT_WINDOW/2];
+    if (++uss->buf_index == MED_FILT_WINDOW) {uss->buf_index = 0;} // Reset back to index 0 if at max
 
     next_state = calculate_distance;
     break;
 
   case calculate_distance:
-    // Use echo high time to calculate distance:
-    //    hw_ticks(micros) / 58 micros per cm = cm
-    // Dereference pointers to update both distance readings
-    g_FrontDist = (uss1->med_echo_high_time) / 58;
-    g_LeftDist = (uss2->med_echo_high_time) / 58;
+    // Use echo high time to calculate distance, for the drift PID. Navigation
+    // compares the ticks against CM_TO_ECHO_TICKS() and never needs this
+    for (int i = 0; i < uss->count; i++) {
+      uss->sensors[i].dist = echo_ticks_to_cm(uss->sensors[i].med_echo_high_time);
+    }
     g_NewReading = true;
-    start_stopwatch(5);
     next_state = cooldown;
     break;
 
   case cooldown:
-    if (read_stopwatch(5) >= USS_READ_INTERVAL*HW_TIME_PER_SEC)
-    {
-      next_state = send_trig;
-    }
+    if (uss_cooldown_done(uss)) {next_state = send_trig;}
     break;
 
   default:
     next_state = send_trig;
   }
-  state = next_state;
+  uss->state = next_state;
+}
+
+// Raises each sensor's trig pin USS_PHASE_US after the previous one and drops
+// it at least USS_TRIG_US later. A sensor is armed as it fires, so no edge
+// from before its own ping is taken as its echo. With USS_PHASE_US at 0 every
+// sensor fires on the same pulse.
+void uss_trigger_service(UssEngine * uss) {
+  uint32_t now = timebase_now();
+  if (uss->trig_high) {
+    if (now - uss->pulse_start < US_TO_TICKS(USS_TRIG_US)) return;
+    JB &= ~uss->trig_high;
+    uss->trig_high = 0;
+  }
+
+  uint32_t fire = 0;
+  while (uss->next_fire < uss->count && (int32_t)(now - uss->next_fire_time) >= 0) {
+    UltrasonicSensor * s = &uss->sensors[uss->next_fire++];
+    uss->next_fire_time += US_TO_TICKS(USS_PHASE_US);
+    s->trig_time = now;
+    if (s->capture) {uss_capture_arm(s);}
+    else {uss->armed |= s->echo_mask;}
+    uss->fired |= s->echo_mask;
+    fire |= s->trig_mask;
+  }
+  if (!fire) return;
+  JB &= ~fire; // Clearing first ensures a rising edge
+  JB |= fire;
+  uss->trig_high = fire;
+  uss->pulse_start = now;
+}
+
+// Staggering the pings leaves an earlier sensor's ping in the air while a
+// later sensor listens. A wall past the threshold for the earlier sensor
+// sends it back while the later one is listening, and if the later sensor
+// hears it its echo ends early and reads as a close wall. An earlier ping
+// comes back when the earlier sensor's own echo ends, so an in-range echo
+// ending within USS_XTALK_WINDOW_US of that, after this sensor fired, may be
+// the earlier ping. Timing alone can't tell it from a real wall at the
+// matching distance, so it is only rejected when it also disagrees with the
+// wall this sensor's median holds. The coincidence moves as the robot does,
+// so a new wall is only held off for a scan or two. Sensors fired together
+// can't be told apart and are never rejected.
+static inline _Bool uss_is_crosstalk(const UssEngine * uss, const UltrasonicSensor * s) {
+  const int32_t window = US_TO_TICKS(USS_XTALK_WINDOW_US);
+  int32_t from_median = (int32_t)((s->fall_time - s->rise_time) - s->med_echo_high_time);
+  if (from_median > -window && from_median < window) return false;
+
+  for (int i = 0; i < uss->count; i++) {
+    const UltrasonicSensor * other = &uss->sensors[i];
+    if (!(uss->fallen & other->echo_mask)) continue;
+    if ((int32_t)(s->trig_time - other->trig_time) <= 0) continue;
+    if ((int32_t)(other->fall_time - s->trig_time) <= 0) continue; // Back before this sensor fired
+    int32_t offset = (int32_t)(s->fall_time - other->fall_time);
+    if (offset > -window && offset < window) return true;
+  }
+  return false;
+}
+
+// The earlier ping may land after this echo ends, so the reading waits until
+// every earlier sensor's echo has ended or USS_XTALK_WINDOW_US has passed
+static inline _Bool uss_xtalk_pending(const UssEngine * uss, const UltrasonicSensor * s, uint32_t now) {
+  if (now - s->fall_time >= US_TO_TICKS(USS_XTALK_WINDOW_US)) return false;
+  for (int i = 0; i < uss->count; i++) {
+    const UltrasonicSensor * other = &uss->sensors[i];
+    if (!(uss->fired & other->echo_mask) || (uss->fallen & other->echo_mask)) continue;
+    if ((int32_t)(s->trig_time - other->trig_time) > 0) return true;
+  }
+  return false;
+}
+
+// Sampled echoes: called by encoder_service() with each filtered JB sample,
+// so edges are stamped to within a sample period of the sampler, not of the
+// FSM. The glitch filter delays both edges alike, so the width is unaffected.
+void uss_echo_sample(UssEngine * uss, uint32_t jb, uint32_t now) {
+  uint32_t echo = jb & uss->armed;
+  uint32_t changed = echo ^ uss->last_echo;
+  uss->last_echo = echo;
+
+  for (int i = 0; changed && i < uss->count; i++) {
+    UltrasonicSensor * s = &uss->sensors[i];
+    if (!(changed & s->echo_mask)) continue;
+    changed &= ~s->echo_mask;
+    if (echo & s->echo_mask) {
+      s->rise_time = now;
+      uss->seen |= s->echo_mask;
+    }
+    else {
+      s->fall_time = now;
+      uss->fallen |= s->echo_mask;
+      uss->armed &= ~s->echo_mask;
+    }
+  }
+}
+
+// Captured echoes: timer 0 latches the rising edge and timer 1 the falling
+// edge. Clearing the event flags lets the next edges in. The capture clock's
+// offset from the timebase is taken at the same time, so captured stamps
+// compare directly with the sampled ones
+static inline void uss_capture_arm(UltrasonicSensor * s) {
+  UINTPTR base = s->capture->BaseAddress;
+  s->capture_offset = timebase_now() - XTmrCtr_GetTimerCounterReg(base, XTC_TIMER_0);
+  for (int t = XTC_TIMER_0; t <= XTC_TIMER_1; t++) {
+    XTmrCtr_SetControlStatusReg(base, t, XTmrCtr_GetControlStatusReg(base, t) | XTC_CSR_INT_OCCURED_MASK);
+  }
 }
 
-void selection_sort(uint32_t intArray[], uint8_t arrayLength)
+void uss_capture_poll(UssEngine * uss) {
+  uint32_t waiting = uss->capture_mask & uss->fired & ~uss->fallen;
+  for (int i = 0; waiting && i < uss->count; i++) {
+    UltrasonicSensor * s = &uss->sensors[i];
+    if (!(waiting & s->echo_mask)) continue;
+    waiting &= ~s->echo_mask;
+    UINTPTR base = s->capture->BaseAddress;
+    if (!(uss->seen & s->echo_mask) && XTmrCtr_HasEventOccurred(base, XTC_TIMER_0)) {
+      s->rise_time = XTmrCtr_GetCaptureValue(s->capture, XTC_TIMER_0) + s->capture_offset;
+      uss->seen |= s->echo_mask;
+    }
+    if ((uss->seen & s->echo_mask) && XTmrCtr_HasEventOccurred(base, XTC_TIMER_1)) {
+      s->fall_time = XTmrCtr_GetCaptureValue(s->capture, XTC_TIMER_1) + s->capture_offset;
+      uss->fallen |= s->echo_mask;
+    }
+  }
+}
+
+// The next ping can go once every echo line has dropped, and once the
+// farthest wall heard has had one more round trip for its echoes to die
+// away, so a second bounce can't read as a near wall. A sensor that timed
+// out still holds its echo high until the real echo returns, so that wait
+// covers it too. Close walls give short echoes and ping every
+// USS_MIN_PERIOD_US. An echo that never drops falls back to USS_MAX_PERIOD_US.
+_Bool uss_cooldown_done(UssEngine * uss) {
+  uint32_t since_trig = timebase_elapsed(uss->trig_time);
+  if (since_trig >= US_TO_TICKS(USS_MAX_PERIOD_US)) return true;
+  if (since_trig < US_TO_TICKS(USS_MIN_PERIOD_US)) return false;
+
+  uss_capture_poll(uss);
+  if (uss->fallen != uss->echo_mask) return false;
+
+  uint32_t guard = US_TO_TICKS(USS_GUARD_MIN_US);
+  for (int i = 0; i < uss->count; i++) {
+    uint32_t width = uss->sensors[i].fall_time - uss->sensors[i].rise_time;
+    if (width > guard) {guard = width;}
+  }
+  for (int i = 0; i < uss->count; i++) {
+    if (timebase_now() - uss->sensors[i].fall_time < guard) return false;
+  }
+  return true;
+}
+
+// Function implementation - Echo Distance
+// Exactly ticks / 5800 (100 ticks per us, 58 us per cm) without a divide or
+// multiply. 5800 = 8 * 725, the 8 is a shift. 1/725 is 2^-10 times
+// 1.0110100100110011111... in binary, those terms are summed from below with
+// each shift taken from the previous one, then the remainder is brought
+// back under 725. The estimate is never more than 1 short.
+static inline uint32_t echo_ticks_to_cm(uint32_t ticks)
 {
-    uint8_t smallest;
+    uint32_t t = ticks >> 3;
+    uint32_t s = t;
+    uint32_t sum = t;
+    s >>= 2; sum += s; // 2^-2
+    s >>= 1; sum += s; // 2^-3
+    s >>= 2; sum += s; // 2^-5
+    s >>= 3; sum += s; // 2^-8
+    s >>= 1; sum += s; // 2^-9
+    s >>= 3; sum += s; // 2^-12
+    s >>= 3; sum += s; // 2^-15
+    s >>= 1; sum += s; // 2^-16
+    s >>= 1; sum += s; // 2^-17
+    s >>= 1; sum += s; // 2^-18
+    s >>= 1; sum += s; // 2^-19
+    s >>= 1; sum += s; // 2^-20
+    uint32_t cm = sum >> 10;
+
+    // r = t - cm * 725, with 725 = 512 + 128 + 64 + 16 + 4 + 1
+    uint32_t r = t - ((cm << 9) + (cm << 7) + (cm << 6) + (cm << 4) + (cm << 2) + cm);
+    while (r >= 725)
+    {
+        r -= 725;
+        cm++;
+    }
+    return cm;
+}
 
-    // Go through all array elements up to the second to last elemnt. On the last 
-    // iteration, there are only two elements left in the unsorted array to compare
-    for (uint8_t currentElement = 0; currentElement < arrayLength - 1; currentElement++)
+// Function implementation - Median Filter
+// Each new reading replaces the oldest one in the sensor's window and the
+// median comes straight back, nothing is copied or fully sorted. The window
+// is kept sorted and each reading moves only the values between the old and
+// new one. MED_FILT_NETWORK switches window 5 to a fixed compare-exchange
+// network, which always costs the same but does more work on average.
+static inline uint32_t median_filter_push(UltrasonicSensor * s, uint8_t index, uint32_t sample)
+{
+    uint32_t old = s->buf[index];
+    s->buf[index] = sample;
+#if MED_FILT_NETWORK && (MED_FILT_WINDOW == 5)
+    (void)old;
+    return median5(s->buf);
+#else
+    median_window_replace(s->sorted, old, sample);
+    return s->sorted[MED_FILT_WINDOW/2]; // Integer division (e.g. 5/2 = 2)
+#endif
+}
+
+// Median of 5 in 7 compare-exchanges, the minimum for this size
+static inline uint32_t median5(const uint32_t window[5])
+{
+    uint32_t a = window[0], b = window[1], c = window[2], d = window[3], e = window[4];
+    sort2(&a, &b);
+    sort2(&d, &e);
+    sort2(&a, &d); // a is now the smallest, out of the running
+    sort2(&b, &e); // e is now the largest, out of the running
+    sort2(&b, &c);
+    sort2(&c, &d);
+    sort2(&b, &c);
+    return c;
+}
+
+// Removes old from the sorted window and inserts sample in its place. The gap
+// left by old slides towards where sample belongs, so only the values between
+// the two are moved
+static inline void median_window_replace(uint32_t sorted[MED_FILT_WINDOW], uint32_t old, uint32_t sample)
+{
+    int i = 0;
+    while (sorted[i] != old) {i++;} // old is always in the window
+
+    while (i > 0 && sorted[i - 1] > sample)
+    {
+        sorted[i] = sorted[i - 1];
+        i--;
+    }
+    while (i < MED_FILT_WINDOW - 1 && sorted[i + 1] < sample)
     {
-        // For the sub-array of currentElement to the end of the array, find the
-        // position of the smallest element
-
-        // Initialize the smallest element to the first element in the sub array
-        smallest = currentElement;
-
-        // Check ALL other elements in the sub array against the current smallest
-        for (int index = currentElement + 1; index < arrayLength; index++)
-        {
-            // If the current element is smaller than the smallest element, update the smallest
-            if (intArray[index] < intArray[smallest])
-            {
-                // We found a new smallest element
-                smallest = index;
-            }
-        }
-
-        // Now that the sub-array has been searched, we have the index of the smallest
-        // value. Now we can swap the values contained in the current element and the
-        // smallest element
-        swap(&intArray[currentElement], &intArray[smallest]);
+        sorted[i] = sorted[i + 1];
+        i++;
     }
+    sorted[i] = sample;
+}
+
+static inline void sort2(uint32_t * pFirst, uint32_t * pSecond)
+{
+    if (*pFirst > *pSecond) {swap(pFirst, pSecond);}
 }
 
 static inline void swap(uint32_t * pFirst, uint32_t * pSecond)
@@ -907,9 +2192,10 @@ static inline void swap(uint32_t * pFirst, uint32_t * pSecond)
 
 void celebration() {
     static uint16_t led_state = 0xAAAA;
-    if (read_stopwatch(2) >= HW_TIME_PER_SEC/2) {
+    static uint32_t last_toggle = 0;
+    if (timebase_elapsed(last_toggle) >= US_TO_TICKS(HW_TIME_PER_SEC/2)) {
         led_state ^= 0xFFFF;
-        start_stopwatch(2);
+        last_toggle = timebase_now();
     }
-    LEDS = led_state;    
+    g_Out.leds = led_state;    
 }
\ No newline at end of file
@@ -0,0 +1,161 @@
+// Feed-forward calibration tool
+// Reads the UART log of a calibration sweep (the FFCAL/FFLUT lines printed by
+// ff_print_table(), anything else is skipped) and for each wheel:
+//  - rebuilds the table from the measured points with the robot's own
+//    ff_build_lut() and checks it matches the FFLUT line the robot printed
+//  - checks speed rises with duty and the table never goes down
+//  - reads every measured speed back through ff_duty() and reports how far
+//    the duty lands from the one that was measured
+//  - fits duty = FF_DUTY_MIN + (velocity >> FF_VEL_SHIFT) to the points, the
+//    uncalibrated model, and prints the table as a C initializer
+// Usage: ff_tool [log], reads stdin without a file. Exits non-zero on a failed check.
+#include <string.h>
+#include "host.h"
+
+#define FF_TOOL_MAX_ERR (1 << FF_CAL_DUTY_SHIFT) // Round trip error allowed, one sweep step
+
+typedef struct {
+  char name;
+  int points;
+  uint32_t vel_q[FF_CAL_POINTS];
+  _Bool have_lut;
+  uint8_t lut[FF_LUT_SIZE];
+} WheelLog;
+
+static WheelLog wheels[2] = {{'L'}, {'R'}};
+
+static WheelLog * wheel_by_name(char name) {
+  for (int w = 0; w < 2; w++) {
+    if (wheels[w].name == name) return &wheels[w];
+  }
+  return NULL;
+}
+
+static int parse_log(FILE * in) {
+  char line[512];
+  int errors = 0;
+  while (fgets(line, sizeof line, in)) {
+    char name;
+    unsigned duty, vel;
+    int used;
+    if (sscanf(line, "FFCAL %c %u %u", &name, &duty, &vel) == 3) {
+      WheelLog * wheel = wheel_by_name(name);
+      if (!wheel || wheel->points >= FF_CAL_POINTS || duty != FF_CAL_DUTY(wheel->points)) {
+        printf("Unexpected calibration point: %s", line);
+        errors++;
+        continue;
+      }
+      wheel->vel_q[wheel->points++] = vel;
+    }
+    else if (sscanf(line, "FFLUT %c%n", &name, &used) == 1) {
+      WheelLog * wheel = wheel_by_name(name);
+      const char * p = line + used;
+      int k = 0;
+      unsigned entry;
+      int n;
+      while (wheel && k < FF_LUT_SIZE && sscanf(p, "%u%n", &entry, &n) == 1) {
+        wheel->lut[k++] = entry;
+        p += n;
+      }
+      if (!wheel || k != FF_LUT_SIZE) {
+        printf("Malformed table: %s", line);
+        errors++;
+        continue;
+      }
+      wheel->have_lut = true;
+    }
+  }
+  return errors;
+}
+
+// Least squares over the points where the wheel moved
+static void fit_linear_model(const WheelLog * wheel) {
+  double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+  for (int p = 0; p < FF_CAL_POINTS; p++) {
+    if (wheel->vel_q[p] == 0) continue;
+    double x = wheel->vel_q[p];
+    double y = FF_CAL_DUTY(p);
+    n++; sx += x; sy += y; sxx += x*x; sxy += x*y;
+  }
+  if (n < 2 || n*sxx == sx*sx) {
+    printf("  %c: too few moving points to fit\n", wheel->name);
+    return;
+  }
+  double slope = (n*sxy - sx*sy) / (n*sxx - sx*sx);
+  double offset = (sy - slope*sx) / n;
+  int shift = 0;
+  while (shift < 31 && slope < 0.7071 / (double)(1u << shift)) {shift++;} // Nearest power of two
+  printf("  %c: duty = %.1f + velocity * %.6f, nearest model FF_DUTY_MIN 0x%02X FF_VEL_SHIFT %d\n",
+         wheel->name, offset, slope, (unsigned)(offset + 0.5), shift);
+}
+
+static int check_wheel(const WheelLog * wheel) {
+  int errors = 0;
+  if (wheel->points != FF_CAL_POINTS) {
+    printf("  %c: %d of %d calibration points\n", wheel->name, wheel->points, FF_CAL_POINTS);
+    return 1;
+  }
+
+  uint8_t lut[FF_LUT_SIZE];
+  memset(lut, 0, sizeof lut);
+  ff_build_lut(lut, wheel->vel_q);
+  if (wheel->have_lut && memcmp(lut, wheel->lut, sizeof lut)) {
+    printf("  %c: printed table differs from the one rebuilt from its points\n", wheel->name);
+    errors++;
+  }
+
+  int dips = 0;
+  for (int p = 1; p < FF_CAL_POINTS; p++) {
+    if (wheel->vel_q[p] < wheel->vel_q[p-1]) dips++;
+  }
+  if (dips) {printf("  %c: speed dropped with more duty at %d point(s), flattened in the table\n", wheel->name, dips);}
+
+  for (int k = 1; k < FF_LUT_SIZE; k++) {
+    if (lut[k] < lut[k-1]) {
+      printf("  %c: table goes down at entry %d\n", wheel->name, k);
+      errors++;
+    }
+  }
+
+  // Only points inside the table's reach and above the last dip can round trip
+  int worst = 0;
+  uint32_t fastest = 0;
+  for (int p = 0; p < FF_CAL_POINTS; p++) {
+    uint32_t vel = wheel->vel_q[p];
+    if (vel <= fastest || vel >= ((FF_LUT_SIZE - 1) << FF_LUT_SHIFT)) continue;
+    fastest = vel;
+    int err = (int)ff_duty(lut, vel) - FF_CAL_DUTY(p);
+    if (err < 0) err = -err;
+    if (err > worst) worst = err;
+  }
+  printf("  %c: worst round trip error %d duty steps\n", wheel->name, worst);
+  if (worst > FF_TOOL_MAX_ERR) {errors++;}
+
+  fit_linear_model(wheel);
+  printf("  %c: {", wheel->name);
+  for (int k = 0; k < FF_LUT_SIZE; k++) {printf(k ? ", %d" : "%d", lut[k]);}
+  printf("}\n");
+  return errors;
+}
+
+int main(int argc, char ** argv) {
+  FILE * in = stdin;
+  if (argc > 1 && !(in = fopen(argv[1], "r"))) {
+    printf("Cannot open %s\n", argv[1]);
+    return 2;
+  }
+
+  int errors = parse_log(in);
+  int found = 0;
+  for (int w = 0; w < 2; w++) {
+    if (!wheels[w].points && !wheels[w].have_lut) continue;
+    found++;
+    errors += check_wheel(&wheels[w]);
+  }
+  if (!found) {
+    printf("No FFCAL/FFLUT lines found\n");
+    return 1;
+  }
+  printf(errors ? "ff_tool: %d problem(s)\n" : "ff_tool: ok\n", errors);
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,21 @@
+// Board support the host doesn't have: xil_printf goes to stdout and a
+// failed driver assert stops the test instead of spinning
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "xil_assert.h"
+#include "xil_printf.h"
+
+u32 Xil_AssertStatus;
+
+void Xil_Assert(const char8 *File, s32 Line) {
+  printf("Driver assert at %s:%d\n", File, (int)Line);
+  exit(3);
+}
+
+void xil_printf(const char8 *ctrl1, ...) {
+  va_list args;
+  va_start(args, ctrl1);
+  vprintf(ctrl1, args);
+  va_end(args);
+}
@@ -0,0 +1,38 @@
+// Shift-add echo conversion against the divide
+// echo_ticks_to_cm() must equal ticks / 5800 for every input. By default
+// every quotient boundary is checked: each multiple of 5800 and the ticks
+// either side of it, across the whole 32-bit range. The bottom 2^24 ticks
+// (past any real echo) and the top of the range are swept whole.
+// With "all" every one of the 2^32 inputs is checked, about 30s on a desktop.
+#include <string.h>
+#include "host.h"
+
+#define ECHO_TICKS_PER_CM 5800u // 100 ticks per us, 58 us per cm
+
+static uint64_t checked = 0;
+static int failures = 0;
+
+static void check_ticks(uint32_t ticks) {
+  uint32_t got = echo_ticks_to_cm(ticks);
+  uint32_t want = ticks / ECHO_TICKS_PER_CM;
+  checked++;
+  if (got == want || failures >= 10) return;
+  failures++;
+  CHECK(got == want, "%u ticks: got %u cm, divide gives %u", ticks, got, want);
+}
+
+int main(int argc, char ** argv) {
+  if (argc > 1 && !strcmp(argv[1], "all")) {
+    uint32_t ticks = 0;
+    do {check_ticks(ticks);} while (++ticks);
+  }
+  else {
+    for (uint32_t ticks = 0; ticks < (1u << 24); ticks++) {check_ticks(ticks);}
+    for (uint64_t edge = ECHO_TICKS_PER_CM; edge <= UINT32_MAX; edge += ECHO_TICKS_PER_CM) {
+      for (uint64_t ticks = edge - 2; ticks <= edge + 2 && ticks <= UINT32_MAX; ticks++) {check_ticks(ticks);}
+    }
+    for (uint32_t ticks = UINT32_MAX - (1u << 20); ticks != 0; ticks++) {check_ticks(ticks);}
+  }
+  printf("%llu inputs checked\n", (unsigned long long)checked);
+  return host_report("test_echo_cm");
+}
@@ -0,0 +1,45 @@
+// Divide-free edge velocity against the exact quotient
+// wheel_edge_velocity() looks the span up in VEL_EDGE_RECIP instead of
+// dividing. Every span from the shortest possible to the stall limit must
+// come out within 1/(2*VEL_RECIP_SIZE) of VEL_EDGE_NUM / span, plus one count
+// for the truncating shifts, with the sign of the last edge.
+#include "host.h"
+
+static double worst = 0;
+
+static void check_span(uint32_t span, int8_t dir) {
+  QuadEncoder enc = {0};
+  uint32_t now = 0x80000000u; // Stamps wrap, any origin works
+  enc.edge_span = span;
+  enc.edge_dir = dir;
+  enc.edge_index = 1;
+  enc.edge_time[0] = now; // Last edge just now, so the span isn't stretched
+
+  int32_t got = wheel_edge_velocity(&enc, now);
+  double want = (double)VEL_EDGE_NUM / span;
+  double err = ((dir < 0 ? -got : got) - want) / want;
+  if (err < 0) err = -err;
+  if (err > worst) worst = err;
+  CHECK(err <= 1.0 / (2*VEL_RECIP_SIZE) + 1.0 / want, "span %u: got %d, exact %.1f", span, got, want);
+  CHECK((dir < 0) == (got < 0), "span %u: sign of %d doesn't follow edge_dir %d", span, got, dir);
+}
+
+int main() {
+  // Every span up to 2^20 ticks, then a sparse sweep out to the stall limit
+  for (uint32_t span = VEL_RECIP_SIZE; span < (1u << 20); span++) {check_span(span, 1);}
+  for (uint32_t span = 1u << 20; span < QUAD_EDGES * VEL_STALL_TICKS; span += 997) {check_span(span, -1);}
+
+  // A wheel that has gone quiet slows down as if the next edge were due now
+  QuadEncoder enc = {0};
+  enc.edge_span = 100000;
+  enc.edge_dir = 1;
+  enc.edge_index = 1;
+  enc.edge_time[0] = 0;
+  int32_t fresh = wheel_edge_velocity(&enc, 0);
+  int32_t late = wheel_edge_velocity(&enc, 100000);
+  CHECK(late < fresh / 2, "no decay between edges: %d then %d", fresh, late);
+  CHECK(wheel_edge_velocity(&enc, VEL_STALL_TICKS) == 0, "stalled wheel still moving");
+
+  printf("worst relative error %.5f, bound %.5f\n", worst, 1.0 / (2*VEL_RECIP_SIZE));
+  return host_report("test_edge_velocity");
+}
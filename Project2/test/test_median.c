@@ -0,0 +1,149 @@
+// Sliding sorted median against the copy-and-sort median it replaced
+// Random streams are pushed through median_filter_push() and through the old
+// method, a selection sort of a copy of the window. The medians and the
+// whole sorted window must match bit for bit. The streams lean on the cases
+// that break sorted windows: repeated values, readings stuck at the timeout
+// and the extremes of the range. median5() is checked the same way.
+// The three are then timed on one stream. Timing is printed, not checked.
+#include <string.h>
+#include <time.h>
+#include "host.h"
+
+#define STREAM_READINGS 200000
+#define BENCH_READINGS (1 << 20)
+
+static uint32_t rng_state = 0x2545F491;
+
+static uint32_t rng() {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+// The median filter before the sliding window
+static void selection_sort(uint32_t * a, int n) {
+  for (int i = 0; i < n - 1; i++) {
+    int min = i;
+    for (int j = i + 1; j < n; j++) {
+      if (a[j] < a[min]) min = j;
+    }
+    uint32_t t = a[i]; a[i] = a[min]; a[min] = t;
+  }
+}
+
+typedef uint32_t (*Reading)();
+
+// A few distinct values, so most of the window is duplicates
+static uint32_t reading_duplicates() {return (rng() & 3) * US_TO_TICKS(100);}
+
+// Walls either side of the threshold, with runs of timeouts: exactly at
+// TIMEOUT_TICKS, or the late fall of an echo that timed out
+static uint32_t reading_timeouts() {
+  uint32_t r = rng();
+  if ((r & 3) == 0) return TIMEOUT_TICKS;
+  if ((r & 3) == 1) return TIMEOUT_TICKS + (r >> 12);
+  return (r >> 8) % (2 * TIMEOUT_TICKS);
+}
+
+// The whole range, ends included
+static uint32_t reading_extremes() {
+  uint32_t r = rng();
+  if ((r & 7) == 0) return 0;
+  if ((r & 7) == 1) return UINT32_MAX;
+  return rng();
+}
+
+// Sensor noise around a wall with the odd outlier
+static uint32_t reading_noisy() {
+  uint32_t r = rng();
+  if ((r & 15) == 0) return r >> 10;
+  return CM_TO_ECHO_TICKS(9) + (r & 0x3FF);
+}
+
+static void check_stream(const char * name, Reading reading) {
+  UltrasonicSensor s;
+  for (int k = 0; k < MED_FILT_WINDOW; k++) {s.buf[k] = US_TO_TICKS(14);}
+  for (int k = 0; k < MED_FILT_WINDOW; k++) {s.sorted[k] = US_TO_TICKS(14);}
+
+  uint8_t index = 0;
+  int failures = 0;
+  for (int n = 0; n < STREAM_READINGS && failures < 5; n++) {
+    uint32_t sample = reading();
+    uint32_t got = median_filter_push(&s, index, sample);
+    if (++index == MED_FILT_WINDOW) {index = 0;}
+
+    uint32_t copy[MED_FILT_WINDOW];
+    memcpy(copy, s.buf, sizeof copy);
+    selection_sort(copy, MED_FILT_WINDOW);
+    uint32_t want = copy[MED_FILT_WINDOW/2];
+
+    _Bool ok = (got == want) && !memcmp(copy, s.sorted, sizeof copy);
+    CHECK(ok, "%s reading %d (%u): median %u, sorted copy gives %u", name, n, sample, got, want);
+    if (!ok) failures++;
+#if MED_FILT_WINDOW == 5
+    CHECK(median5(s.buf) == want, "%s reading %d: median5 %u, sorted copy gives %u", name, n, median5(s.buf), want);
+#endif
+  }
+}
+
+static double seconds_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Host timing only, on the noisy wall stream the robot sees most
+static void benchmark() {
+  static uint32_t stream[BENCH_READINGS];
+  for (int n = 0; n < BENCH_READINGS; n++) {stream[n] = reading_noisy();}
+  volatile uint32_t sink = 0;
+  UltrasonicSensor s;
+
+  for (int k = 0; k < MED_FILT_WINDOW; k++) {s.buf[k] = US_TO_TICKS(14);}
+  uint8_t index = 0;
+  double start = seconds_now();
+  for (int n = 0; n < BENCH_READINGS; n++) {
+    s.buf[index] = stream[n];
+    if (++index == MED_FILT_WINDOW) {index = 0;}
+    uint32_t copy[MED_FILT_WINDOW];
+    memcpy(copy, s.buf, sizeof copy);
+    selection_sort(copy, MED_FILT_WINDOW);
+    sink += copy[MED_FILT_WINDOW/2];
+  }
+  double sort_ns = (seconds_now() - start) * 1e9 / BENCH_READINGS;
+
+  for (int k = 0; k < MED_FILT_WINDOW; k++) {s.buf[k] = US_TO_TICKS(14);}
+  for (int k = 0; k < MED_FILT_WINDOW; k++) {s.sorted[k] = US_TO_TICKS(14);}
+  index = 0;
+  start = seconds_now();
+  for (int n = 0; n < BENCH_READINGS; n++) {
+    sink += median_filter_push(&s, index, stream[n]);
+    if (++index == MED_FILT_WINDOW) {index = 0;}
+  }
+  double sliding_ns = (seconds_now() - start) * 1e9 / BENCH_READINGS;
+
+  printf("host ns/reading: selection sort %.1f sliding window %.1f", sort_ns, sliding_ns);
+#if MED_FILT_WINDOW == 5
+  for (int k = 0; k < MED_FILT_WINDOW; k++) {s.buf[k] = US_TO_TICKS(14);}
+  index = 0;
+  start = seconds_now();
+  for (int n = 0; n < BENCH_READINGS; n++) {
+    s.buf[index] = stream[n];
+    if (++index == MED_FILT_WINDOW) {index = 0;}
+    sink += median5(s.buf);
+  }
+  printf(" median5 %.1f", (seconds_now() - start) * 1e9 / BENCH_READINGS);
+#endif
+  printf("\n");
+  (void)sink;
+}
+
+int main() {
+  check_stream("duplicates", reading_duplicates);
+  check_stream("timeouts", reading_timeouts);
+  check_stream("extremes", reading_extremes);
+  check_stream("noisy wall", reading_noisy);
+  benchmark();
+  return host_report("test_median");
+}
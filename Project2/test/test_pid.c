@@ -0,0 +1,101 @@
+// Q12 fixed-point PID against the float PID it replaced
+// The float reference is the old PID_Controller_enc() expression: the
+// correction is truncated toward zero and saturated at 0xFF either way.
+// The only expected difference is the Q12 rounding of the gains, so every
+// output must agree to within 1 duty step. Timing is printed, not checked.
+#include <time.h>
+#include "host.h"
+
+#define PID_TOLERANCE 1
+#define BENCH_UPDATES 2000000
+
+typedef struct {
+  float kp;
+  float ki;
+  float kd;
+  int32_t error_sum;
+  int32_t error_prev;
+} PidFloat;
+
+static int32_t pid_float_output(PidFloat * pid, int32_t error) {
+  pid->error_sum += error;
+  int32_t error_diff = error - pid->error_prev;
+  pid->error_prev = error;
+
+  float correction = pid->kp*error + pid->ki*pid->error_sum + pid->kd*error_diff;
+  if (correction >= 255.00f) return PID_OUT_MAX;
+  if (correction <= -255.00f) return -PID_OUT_MAX;
+  return (int32_t)correction;
+}
+
+typedef int32_t (*ErrorAt)(int tick);
+
+static int32_t step_up(int tick) {return 40;}
+static int32_t step_small(int tick) {return 3;}
+static int32_t step_down(int tick) {return -120;}
+static int32_t ramp(int tick) {return tick - 200;}
+static int32_t ramp_back(int tick) {return (tick < 250) ? tick : 500 - tick;}
+
+static void compare(const char * name, PidQ gains, float kp, float ki, float kd, ErrorAt error_at, int ticks) {
+  PidQ fixed = gains;
+  PidFloat ref = {kp, ki, kd, 0, 0};
+  pid_q_reset(&fixed);
+
+  int worst = 0;
+  for (int t = 0; t < ticks; t++) {
+    int32_t e = error_at(t);
+    int32_t got = pid_q_output(&fixed, e);
+    int32_t want = pid_float_output(&ref, e);
+    int diff = (got > want) ? got - want : want - got;
+    if (diff > worst) {worst = diff;}
+    CHECK(diff <= PID_TOLERANCE, "%s tick %d error %d: fixed %d float %d", name, t, e, got, want);
+  }
+  printf("%-22s worst difference %d over %d ticks\n", name, worst, ticks);
+}
+
+static double seconds_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Host timing only, the host has an FPU and a multiplier the MicroBlaze lacks.
+// The target cost of pid_q_mul() is one loop pass per gain bit, printed too
+static void benchmark() {
+  volatile int32_t sink = 0;
+  PidQ fixed = EncPid;
+  PidFloat ref = {KP_enc, KI_enc, KD_enc, 0, 0};
+
+  double start = seconds_now();
+  for (int i = 0; i < BENCH_UPDATES; i++) {
+    if ((i & 255) == 0) {pid_q_reset(&fixed);}
+    sink += pid_q_output(&fixed, (i & 63) - 32);
+  }
+  double fixed_ns = (seconds_now() - start) * 1e9 / BENCH_UPDATES;
+
+  start = seconds_now();
+  for (int i = 0; i < BENCH_UPDATES; i++) {
+    if ((i & 255) == 0) {ref.error_sum = 0; ref.error_prev = 0;}
+    sink += pid_float_output(&ref, (i & 63) - 32);
+  }
+  double float_ns = (seconds_now() - start) * 1e9 / BENCH_UPDATES;
+
+  int loop_passes = 0;
+  for (int32_t g = EncPid.kp; g; g >>= 1) loop_passes++;
+  for (int32_t g = EncPid.ki; g; g >>= 1) loop_passes++;
+  for (int32_t g = EncPid.kd; g; g >>= 1) loop_passes++;
+  printf("host ns/update: fixed %.1f float %.1f, shift-add passes/update %d\n", fixed_ns, float_ns, loop_passes);
+  (void)sink;
+}
+
+int main() {
+  compare("enc step", EncPid, KP_enc, KI_enc, KD_enc, step_up, 400);
+  compare("enc small step", EncPid, KP_enc, KI_enc, KD_enc, step_small, 2000);
+  compare("enc negative step", EncPid, KP_enc, KI_enc, KD_enc, step_down, 400);
+  compare("enc ramp", EncPid, KP_enc, KI_enc, KD_enc, ramp, 400);
+  compare("enc ramp and back", EncPid, KP_enc, KI_enc, KD_enc, ramp_back, 500);
+  compare("velocity step", LeftWheel.pid, KP_vel, KI_vel, KD_vel, step_up, 400);
+  compare("velocity ramp", LeftWheel.pid, KP_vel, KI_vel, KD_vel, ramp, 400);
+  benchmark();
+  return host_report("test_pid");
+}
@@ -0,0 +1,74 @@
+// Q16 trapezoidal velocity profile
+// Runs profile_step() to completion for short moves, which never reach cruise
+// (triangular), and long ones, which hold cruise (trapezoidal). The position
+// setpoint must end exactly on the target without passing it, and the speed
+// must never go negative or change faster than the accel/decel limits.
+#include "host.h"
+
+#define PROFILE_MAX_TICKS (60 * CONTROL_RATE_HZ)
+
+typedef enum {
+  triangular,
+  trapezoidal,
+} profile_shape;
+
+static void check_profile(const char * name, uint32_t target_cnt, uint32_t cruise_q,
+                          uint32_t accel_q, uint32_t decel_q, profile_shape shape) {
+  VelocityProfile p;
+  profile_start(&p, target_cnt, cruise_q, accel_q, decel_q);
+
+  uint32_t peak = 0;
+  uint32_t last_moving_vel = 0;
+  int ticks = 0;
+  while (!p.done && ticks < PROFILE_MAX_TICKS) {
+    uint32_t pos_before = p.pos_q;
+    int32_t vel_before = (int32_t)p.vel_q;
+    profile_step(&p);
+    ticks++;
+
+    int32_t vel = (int32_t)p.vel_q;
+    CHECK(vel >= 0, "%s tick %d: speed %d is negative", name, ticks, vel);
+    CHECK(p.vel_q <= cruise_q, "%s tick %d: speed %u above cruise %u", name, ticks, p.vel_q, cruise_q);
+    CHECK(p.pos_q >= pos_before, "%s tick %d: position went back", name, ticks);
+    CHECK(p.pos_q <= p.target_q, "%s tick %d: position %u past target %u", name, ticks, p.pos_q, p.target_q);
+    if (!p.done) {
+      CHECK(vel - vel_before <= (int32_t)accel_q, "%s tick %d: accelerated by %d", name, ticks, vel - vel_before);
+      CHECK(vel_before - vel <= (int32_t)decel_q, "%s tick %d: decelerated by %d", name, ticks, vel_before - vel);
+      last_moving_vel = p.vel_q;
+    }
+    if (p.vel_q > peak) {peak = p.vel_q;}
+  }
+
+  CHECK(p.done, "%s: not done after %d ticks", name, ticks);
+  CHECK(p.pos_q == target_cnt << PROFILE_Q_BITS, "%s: ended at %u, target %u", name, p.pos_q, target_cnt << PROFILE_Q_BITS);
+  CHECK(p.vel_q == 0, "%s: still moving at the end", name);
+  CHECK(last_moving_vel <= decel_q + PROFILE_MIN_VEL, "%s: arrived at speed %u", name, last_moving_vel);
+  if (shape == triangular) {CHECK(peak < cruise_q, "%s: reached cruise on a short move", name);}
+  else {CHECK(peak == cruise_q, "%s: peaked at %u, never reached cruise %u", name, peak, cruise_q);}
+  printf("%-20s %5u counts in %5d ticks, peak %u of cruise %u\n", name, target_cnt, ticks, peak, cruise_q);
+}
+
+int main() {
+  uint32_t straight_cruise = CPS_TO_VEL_Q(STRAIGHT_CRUISE_CPS);
+  uint32_t straight_accel = CPS2_TO_ACC_Q(STRAIGHT_ACCEL_CPS2);
+  uint32_t straight_decel = CPS2_TO_ACC_Q(STRAIGHT_DECEL_CPS2);
+  uint32_t turn_cruise = CPS_TO_VEL_Q(TURN_CRUISE_CPS);
+  uint32_t turn_accel = CPS2_TO_ACC_Q(TURN_ACCEL_CPS2);
+  uint32_t turn_decel = CPS2_TO_ACC_Q(TURN_DECEL_CPS2);
+
+  check_profile("straight 1 inch", CNT_PER_INCH, straight_cruise, straight_accel, straight_decel, triangular);
+  check_profile("straight 2 inch", 2*CNT_PER_INCH, straight_cruise, straight_accel, straight_decel, triangular);
+  check_profile("straight 8 inch", 8*CNT_PER_INCH, straight_cruise, straight_accel, straight_decel, trapezoidal);
+  check_profile("straight 48 inch", 48*CNT_PER_INCH, straight_cruise, straight_accel, straight_decel, trapezoidal);
+  check_profile("pivot 30 deg", arc_counts(WHEEL_HALF_BASE_Q8, 30), turn_cruise, turn_accel, turn_decel, triangular);
+  check_profile("pivot 90 deg", arc_counts(WHEEL_HALF_BASE_Q8, 90), turn_cruise, turn_accel, turn_decel, trapezoidal);
+  check_profile("pivot 180 deg", arc_counts(WHEEL_HALF_BASE_Q8, 180), turn_cruise, turn_accel, turn_decel, trapezoidal);
+
+  // Odd sizes: a count or two, and rates that don't divide the distance evenly
+  for (uint32_t cnt = 1; cnt <= 400; cnt += 7) {
+    char name[32];
+    snprintf(name, sizeof name, "odd %u counts", cnt);
+    check_profile(name, cnt, straight_cruise, straight_accel, straight_decel, triangular);
+  }
+  return host_report("test_profile");
+}
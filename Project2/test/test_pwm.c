@@ -0,0 +1,44 @@
+// Hardware PWM register math against the tmrctr driver
+// init_motor_pwm() and set_wheel_duty() run unchanged, the driver writes the
+// RAM register model and the test reads TLR/TCSR back the way the timer
+// would: period is TLR0 + 2 ticks, high time is TLR1 + 2 ticks.
+#include "host.h"
+
+static uint32_t pwm_reg(const PwmChannel * pwm, int timer, uint32_t offset) {
+  return XTmrCtr_ReadReg(pwm->timer.BaseAddress, timer, offset);
+}
+
+static void check_channel(PwmChannel * pwm, const char * wheel) {
+  uint32_t period = pwm_reg(pwm, XTC_TIMER_0, XTC_TLR_OFFSET) + 2;
+  CHECK(period == PWM_PERIOD_TICKS, "%s period %u ticks, expected %u", wheel, period, PWM_PERIOD_TICKS);
+  CHECK(!(pwm_reg(pwm, XTC_TIMER_0, XTC_TCSR_OFFSET) & XTC_CSR_ENABLE_PWM_MASK), "%s PWM on before any duty", wheel);
+
+  for (int duty = 1; duty <= PWM_TOP; duty++) {
+    set_wheel_duty(pwm, duty);
+    uint32_t high = pwm_reg(pwm, XTC_TIMER_1, XTC_TLR_OFFSET) + 2;
+    CHECK(high * (PWM_TOP + 1) == (uint32_t)duty * period, "%s duty %d gives %u of %u ticks high", wheel, duty, high, period);
+    CHECK(pwm_reg(pwm, XTC_TIMER_0, XTC_TCSR_OFFSET) & XTC_CSR_ENABLE_PWM_MASK, "%s duty %d timer 0 not in PWM", wheel, duty);
+    CHECK(pwm_reg(pwm, XTC_TIMER_1, XTC_TCSR_OFFSET) & XTC_CSR_ENABLE_PWM_MASK, "%s duty %d timer 1 not in PWM", wheel, duty);
+  }
+
+  // A repeated duty must not touch the timer
+  XTmrCtr_WriteReg(pwm->timer.BaseAddress, XTC_TIMER_1, XTC_TLR_OFFSET, 0xDEAD);
+  set_wheel_duty(pwm, PWM_TOP);
+  CHECK(pwm_reg(pwm, XTC_TIMER_1, XTC_TLR_OFFSET) == 0xDEAD, "%s repeated duty rewrote TLR1", wheel);
+  XTmrCtr_SetLoadReg(pwm->timer.BaseAddress, XTC_TIMER_1, pwm_duty_to_high_tlr(PWM_TOP));
+
+  // Duty 0 has no high time to load, the output is switched off instead
+  set_wheel_duty(pwm, 0);
+  CHECK(!(pwm_reg(pwm, XTC_TIMER_0, XTC_TCSR_OFFSET) & XTC_CSR_ENABLE_PWM_MASK), "%s duty 0 left timer 0 in PWM", wheel);
+  CHECK(!(pwm_reg(pwm, XTC_TIMER_1, XTC_TCSR_OFFSET) & XTC_CSR_ENABLE_PWM_MASK), "%s duty 0 left timer 1 in PWM", wheel);
+  set_wheel_duty(pwm, 0x80);
+  CHECK(pwm_reg(pwm, XTC_TIMER_0, XTC_TCSR_OFFSET) & XTC_CSR_ENABLE_PWM_MASK, "%s PWM not back on after duty 0", wheel);
+}
+
+int main() {
+  host_map_peripherals();
+  init_motor_pwm();
+  check_channel(&LeftPwm, "left");
+  check_channel(&RightPwm, "right");
+  return host_report("test_pwm");
+}
@@ -0,0 +1,159 @@
+// Staggered ultrasonic pings against crosstalk
+// Runs the scan engine against the RAM timebase with both echoes sampled.
+// Each scan plays scripted echo edges, as offsets from each sensor's own
+// trigger stamp, through uss_echo_sample(). The left sensor fires
+// USS_PHASE_US after the front one. When its echo ends where the front ping
+// comes back, and doesn't match the wall its median holds, it must be
+// rejected, whichever of the two edges is stamped first. A real close wall
+// must still get through, including the left wall at the setpoint while the
+// front wall's echo ends at the same moment on the approach to a dead end.
+#include "host.h"
+
+#define SIM_STEP_TICKS US_TO_TICKS(10) // Sampler period
+#define SIM_MAX_TICKS US_TO_TICKS(USS_MAX_PERIOD_US + USS_MIN_PERIOD_US)
+#define SIM_CM_TO_US(cm) ((cm) * 58 / 10 * 10) // Echo width, to the sampler period
+
+typedef struct {
+  uint32_t rise_us; // Echo edges after the sensor's own trigger
+  uint32_t fall_us;
+} EchoScript;
+
+static UltrasonicSensor sensors[uss_count] = {
+  [uss_front] = {.trig_mask = FRONT_TRIG_MASK, .echo_mask = FRONT_ECHO_MASK},
+  [uss_left]  = {.trig_mask = LEFT_TRIG_MASK, .echo_mask = LEFT_ECHO_MASK},
+};
+static UssEngine eng;
+static uint32_t sim_now = 0xFFF00000u; // Scans cross the timebase wrap
+
+static void sim_step() {
+  sim_now += SIM_STEP_TICKS;
+  host_set_time(sim_now);
+}
+
+static uint32_t echo_level(const EchoScript script[uss_count]) {
+  uint32_t jb = 0;
+  for (int i = 0; i < uss_count; i++) {
+    if (!(eng.fired & sensors[i].echo_mask)) continue;
+    uint32_t since = sim_now - sensors[i].trig_time;
+    if (since >= US_TO_TICKS(script[i].rise_us) && since < US_TO_TICKS(script[i].fall_us)) {jb |= sensors[i].echo_mask;}
+  }
+  return jb;
+}
+
+// Runs one scan from its trigger to the new reading
+static void run_scan(const EchoScript script[uss_count]) {
+  uint32_t start = sim_now;
+  while (eng.state != send_trig && sim_now - start < SIM_MAX_TICKS) {
+    uss_engine_step(&eng);
+    sim_step();
+  }
+  g_NewReading = false;
+  while (!g_NewReading && sim_now - start < 2 * SIM_MAX_TICKS) {
+    uss_engine_step(&eng);
+    uss_echo_sample(&eng, echo_level(script), sim_now);
+    sim_step();
+  }
+  CHECK(g_NewReading, "scan never finished");
+}
+
+static void check_scan(const char * name, const EchoScript script[uss_count], _Bool rejected) {
+  uint32_t before = eng.crosstalk;
+  run_scan(script);
+  uint32_t want = US_TO_TICKS(script[uss_left].fall_us - script[uss_left].rise_us);
+  uint32_t raw = sensors[uss_left].raw_echo_high_time;
+  if (want < TIMEOUT_TICKS) {CHECK(raw == want, "%s: left echo %u ticks, scripted %u", name, raw, want);}
+  CHECK(!(eng.rejected & sensors[uss_front].echo_mask), "%s: front reading rejected", name);
+  if (rejected) {
+    CHECK(eng.rejected & sensors[uss_left].echo_mask, "%s: left echo of %u ticks taken as a wall", name, raw);
+    CHECK(eng.crosstalk == before + 1, "%s: crosstalk count %u, was %u", name, eng.crosstalk, before);
+  }
+  else {
+    CHECK(!(eng.rejected & sensors[uss_left].echo_mask), "%s: real wall rejected", name);
+    CHECK(eng.crosstalk == before, "%s: crosstalk count %u, was %u", name, eng.crosstalk, before);
+  }
+}
+
+int main() {
+  host_map_peripherals();
+  host_set_time(sim_now);
+  uss_engine_init(&eng, sensors, uss_count);
+
+  // Front sees a far wall, its ping back at 1800us. Left, fired USS_PHASE_US
+  // later, hears it and its echo ends at the same moment: an in-range reading
+  const uint32_t back = 1800;
+  const uint32_t left_fire = USS_PHASE_US;
+  const EchoScript heard_after[uss_count] = {
+    [uss_front] = {200, back},
+    [uss_left]  = {200, back - left_fire + 50},
+  };
+  check_scan("left ends after front", heard_after, true);
+
+  // Left's echo ends first and front's only lands inside the window, the
+  // left reading has to wait for it
+  const EchoScript heard_before[uss_count] = {
+    [uss_front] = {200, back + 150},
+    [uss_left]  = {200, back - left_fire},
+  };
+  check_scan("left ends before front", heard_before, true);
+
+  // A run of crosstalk never reaches the left median
+  uint32_t median = sensors[uss_left].med_echo_high_time;
+  for (int n = 0; n < MED_FILT_WINDOW; n++) {check_scan("crosstalk run", heard_after, true);}
+  CHECK(sensors[uss_left].med_echo_high_time == median, "crosstalk moved the left median from %u to %u",
+        median, sensors[uss_left].med_echo_high_time);
+
+  // A real wall on the left, front's ping comes back long after
+  const EchoScript real_wall[uss_count] = {
+    [uss_front] = {200, 3000},
+    [uss_left]  = {200, 500},
+  };
+  check_scan("real left wall", real_wall, false);
+
+  // Both walls close, front's ping is back before left even fires
+  const EchoScript both_close[uss_count] = {
+    [uss_front] = {200, 600},
+    [uss_left]  = {200, 450},
+  };
+  check_scan("both close", both_close, false);
+
+  // Left timed out, nothing to reject
+  const EchoScript left_far[uss_count] = {
+    [uss_front] = {200, back},
+    [uss_left]  = {200, 200 + TIMEOUT_TICKS / US_TO_TICKS(1) + 100},
+  };
+  check_scan("left past threshold", left_far, false);
+
+  for (int n = 0; n < MED_FILT_WINDOW; n++) {check_scan("real wall run", real_wall, false);}
+  CHECK(sensors[uss_left].med_echo_high_time == US_TO_TICKS(300), "real wall median %u, expected %u",
+        sensors[uss_left].med_echo_high_time, US_TO_TICKS(300));
+
+  // Following the left wall at the setpoint into a dead end: the front wall
+  // passes through the distance where both echoes end together
+  const uint32_t setpoint_us = 200 + SIM_CM_TO_US(LEFT_DIST_SETPOINT);
+  const EchoScript following[uss_count] = {
+    [uss_front] = {200, 5000},
+    [uss_left]  = {200, setpoint_us},
+  };
+  for (int n = 0; n < MED_FILT_WINDOW; n++) {check_scan("following left wall", following, false);}
+  for (uint32_t front_cm = 21; front_cm <= 31; front_cm++) {
+    const EchoScript dead_end[uss_count] = {
+      [uss_front] = {200, 200 + SIM_CM_TO_US(front_cm)},
+      [uss_left]  = {200, setpoint_us},
+    };
+    char name[32];
+    snprintf(name, sizeof name, "dead end front %ucm", front_cm);
+    check_scan(name, dead_end, false);
+  }
+
+  // Crosstalk still shows while following the wall, a short echo ending with
+  // the front one
+  const uint32_t short_us = 200 + SIM_CM_TO_US(3);
+  const EchoScript following_crosstalk[uss_count] = {
+    [uss_front] = {200, left_fire + short_us},
+    [uss_left]  = {200, short_us},
+  };
+  check_scan("crosstalk while following", following_crosstalk, true);
+
+  printf("crosstalk rejected %u\n", eng.crosstalk);
+  return host_report("test_uss_crosstalk");
+}